@@ -0,0 +1,239 @@
+// Puerta de regresiones: compara varias corridas de bench_suite contra una
+// línea base guardada en el repositorio.
+//
+//   bench_gate [-b base.json] [-s bench1,bench2] [-t umbral] corrida1.json ...
+//   bench_gate -w base.json corrida1.json ...
+//
+// De cada corrida se toma la mediana (p50_ms) de cada benchmark; entre
+// corridas se calcula la mediana y su intervalo de confianza del 95% por
+// estadísticos de orden (sin suponer normalidad). Un benchmark regresa si
+// su mediana supera la de la base en más del umbral (10% por defecto) y
+// además su intervalo queda entero por encima del de la base. Sale con 1
+// si alguno regresa, 0 si no. Con -w escribe la base en vez de comparar.
+// Hacen falta al menos MIN_RUNS corridas: con menos, el intervalo [mín, máx]
+// cubre menos del 95% y una sola corrida rápida ocultaría una regresión,
+// así que sale con 2 sin comparar.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_RUNS 64
+#define MAX_BENCH 32
+#define MIN_RUNS 6        // el menor n con P(Bin(n, 1/2) = 0) <= 2.5%
+
+typedef struct {
+    char name[32];
+    int n;
+    double sample[MAX_RUNS];
+    double median, lo, hi;
+    double coverage;      // cobertura real de [lo, hi]; 0 si no hay intervalo
+} Series;
+
+static Series series[MAX_BENCH];
+static int nseries = 0;
+
+static char *read_file(const char *file) {
+    FILE *f = fopen(file, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buf = malloc(len + 1);
+    if (buf && fread(buf, 1, len, f) != (size_t)len) { free(buf); buf = NULL; }
+    if (buf) buf[len] = '\0';
+    fclose(f);
+    return buf;
+}
+
+static Series *series_get(const char *name) {
+    for (int i = 0; i < nseries; i++)
+        if (strcmp(series[i].name, name) == 0) return &series[i];
+    if (nseries == MAX_BENCH) return NULL;
+    Series *s = &series[nseries++];
+    memset(s, 0, sizeof(*s));
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    return s;
+}
+
+// Valor numérico de "campo" dentro del objeto que empieza en obj (hasta '}')
+static int json_field(const char *obj, const char *field, double *v) {
+    char key[48];
+    snprintf(key, sizeof(key), "\"%s\"", field);
+    const char *end = strchr(obj, '}');
+    const char *p = strstr(obj, key);
+    if (!p || (end && p > end)) return 0;
+    p = strchr(p + strlen(key), ':');
+    if (!p) return 0;
+    char *e;
+    *v = strtod(p + 1, &e);
+    return e != p + 1;
+}
+
+// Recorre los objetos "nombre": {...} del bloque "results" y llama a fn
+static int json_results(const char *text, void (*fn)(const char *name, const char *obj, void *ctx), void *ctx) {
+    const char *p = strstr(text, "\"results\"");
+    if (!p || !(p = strchr(p, '{'))) return 0;
+    p++;
+    int n = 0;
+    while ((p = strchr(p, '"')) != NULL) {
+        const char *q = strchr(p + 1, '"');
+        if (!q) break;
+        char name[32];
+        snprintf(name, sizeof(name), "%.*s", (int)(q - p - 1), p + 1);
+        const char *obj = q + 1;
+        while (*obj == ' ' || *obj == ':') obj++;
+        if (*obj != '{') break;
+        fn(name, obj, ctx);
+        n++;
+        p = strchr(obj, '}');
+        if (!p) break;
+        p++;
+        while (*p == ' ' || *p == '\n' || *p == ',') p++;
+        if (*p == '}') break;
+    }
+    return n;
+}
+
+// Nombre en la lista separada por comas (lista vacía: todos)
+static int selected(const char *list, const char *name) {
+    if (!list) return 1;
+    size_t len = strlen(name);
+    for (const char *p = list; (p = strstr(p, name)) != NULL; p += len)
+        if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) return 1;
+    return 0;
+}
+
+static void add_run(const char *name, const char *obj, void *ctx) {
+    double v;
+    if (!selected(ctx, name) || !json_field(obj, "p50_ms", &v)) return;
+    Series *s = series_get(name);
+    if (s && s->n < MAX_RUNS) s->sample[s->n++] = v;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Mediana y su IC del 95%: [x_(k), x_(n-k+1)] con el mayor k tal que
+// P(Bin(n, 1/2) < k) <= 2.5%. Su cobertura real es 1 - 2 P(Bin(n, 1/2) < k),
+// algo más del 95% (97.9% con 10 corridas). Con menos de MIN_RUNS no hay
+// tal k: queda [mín, máx] con cobertura 0 y main no compara.
+static void summarize(Series *s) {
+    int n = s->n;
+    qsort(s->sample, n, sizeof(double), cmp_double);
+    s->median = n % 2 ? s->sample[n / 2] : (s->sample[n / 2 - 1] + s->sample[n / 2]) / 2;
+    double cdf = 0, tail = 0, term = pow(0.5, n);   // P(X = 0)
+    int k = 0;
+    while (k < n / 2) {
+        cdf += term;                        // P(X <= k) = P(X < k + 1)
+        if (cdf > 0.025) break;
+        tail = cdf;                         // P(X < k + 1) del k siguiente
+        term = term * (n - k) / (k + 1);
+        k++;
+    }
+    s->coverage = k ? 1 - 2 * tail : 0;
+    s->lo = s->sample[k ? k - 1 : 0];
+    s->hi = s->sample[k ? n - k : n - 1];
+}
+
+typedef struct {
+    double median, lo, hi;
+    int found;
+} Baseline;
+
+static void read_base(const char *name, const char *obj, void *ctx) {
+    Baseline *b = ctx;
+    Series *s = NULL;
+    for (int i = 0; i < nseries; i++)
+        if (strcmp(series[i].name, name) == 0) s = &series[i];
+    if (!s) return;
+    Baseline *e = &b[s - series];
+    e->found = json_field(obj, "median_ms", &e->median) &&
+               json_field(obj, "ci_lo_ms", &e->lo) && json_field(obj, "ci_hi_ms", &e->hi);
+}
+
+static int write_base(const char *file, int runs) {
+    FILE *f = fopen(file, "w");
+    if (!f) { perror(file); return 2; }
+    fprintf(f, "{\n  \"runs\": %d,\n  \"ci_coverage\": %.4f,\n  \"results\": {\n", runs, series[0].coverage);
+    for (int i = 0; i < nseries; i++)
+        fprintf(f, "    \"%s\": {\"median_ms\": %.4f, \"ci_lo_ms\": %.4f, \"ci_hi_ms\": %.4f}%s\n",
+                series[i].name, series[i].median, series[i].lo, series[i].hi,
+                i == nseries - 1 ? "" : ",");
+    fprintf(f, "  }\n}\n");
+    fclose(f);
+    printf("Base con %d benchmarks en %s\n", nseries, file);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *base = "bench/baseline.json", *out = NULL, *only = NULL;
+    double threshold = 0.10;
+    int runs = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) base = argv[++i];
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) out = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) only = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) threshold = atof(argv[++i]);
+        else {
+            char *text = read_file(argv[i]);
+            if (!text || !json_results(text, add_run, (void *)only)) {
+                fprintf(stderr, "%s: no es una salida de bench_suite\n", argv[i]);
+                free(text);
+                return 2;
+            }
+            free(text);
+            runs++;
+        }
+    }
+    if (runs == 0) {
+        fprintf(stderr, "uso: %s [-b base.json] [-s b1,b2] [-t umbral] corrida.json ...\n"
+                        "       %s -w base.json corrida.json ...\n", argv[0], argv[0]);
+        return 2;
+    }
+    double coverage = 1;
+    for (int i = 0; i < nseries; i++) {
+        summarize(&series[i]);
+        if (series[i].coverage < coverage) coverage = series[i].coverage;
+    }
+    if (coverage < 0.95) {
+        fprintf(stderr, "%d corridas no bastan para un IC del 95%% de la mediana: hacen falta al menos %d "
+                        "(p. ej. BENCH_RUNS=10)\n", runs, MIN_RUNS);
+        return 2;
+    }
+    if (out) return write_base(out, runs);
+
+    char *text = read_file(base);
+    if (!text) { perror(base); return 2; }
+    Baseline b[MAX_BENCH];
+    memset(b, 0, sizeof(b));
+    json_results(text, read_base, b);
+    free(text);
+
+    int regressions = 0;
+    printf("%-14s %10s %21s %10s %21s %8s\n", "benchmark", "base ms", "IC 95%", "ahora ms", "IC 95%", "cambio");
+    for (int i = 0; i < nseries; i++) {
+        Series *s = &series[i];
+        if (!b[i].found) {
+            printf("%-14s %10s %21s %10.3f [%8.3f, %8.3f] %8s\n", s->name, "-", "", s->median, s->lo, s->hi, "nuevo");
+            continue;
+        }
+        double change = b[i].median > 0 ? s->median / b[i].median - 1 : 0;
+        int slow = change > threshold && s->lo > b[i].hi;
+        regressions += slow;
+        printf("%-14s %10.3f [%8.3f, %8.3f] %10.3f [%8.3f, %8.3f] %+7.1f%%%s\n", s->name,
+               b[i].median, b[i].lo, b[i].hi, s->median, s->lo, s->hi, 100 * change,
+               slow ? "  REGRESIÓN" : "");
+    }
+    if (regressions) {
+        printf("%d benchmark(s) más lentos que la base (umbral %.0f%%, %d corridas, cobertura del IC %.1f%%)\n",
+               regressions, 100 * threshold, runs, 100 * coverage);
+        return 1;
+    }
+    printf("Sin regresiones (umbral %.0f%%, %d corridas, cobertura del IC %.1f%%)\n",
+           100 * threshold, runs, 100 * coverage);
+    return 0;
+}
@@ -0,0 +1,76 @@
+// Compara filtros y búsquedas con índice declarado (:index) frente al
+// recorrido de la columna. Uso: bench/bench_index [consultas]
+#define main yape_main
+#include "../yape.c"
+#undef main
+
+static void fill_sheet() {
+    nrows = MAX_ROWS - 1;
+    ncols = 2;
+    srand(42);
+    for (int i = 0; i < nrows; i++) {
+        snprintf(sheet[i][0].data, CELL_LEN, "cliente%d", rand() % 5000);
+        snprintf(sheet[i][1].data, CELL_LEN, "%d", rand() % 100000);
+    }
+    sheet_touch();
+}
+
+// Ejecuta las consultas con o sin los índices declarados
+static double run(int queries, int indexed, long *hits) {
+    static unsigned char rows[MAX_ROWS];
+    for (int k = 0; k < MAX_LOOKUP_INDEX; k++)
+        if (lookup_ix[k].used) lookup_ix[k].declared = indexed;
+    srand(7);
+    *hits = 0;
+    double t0 = now_ms();
+    for (int q = 0; q < queries; q++) {
+        char x[32];
+        snprintf(x, sizeof(x), "%d", rand() % 100000);
+        filter_eval(1, q % 2 ? FILTER_GE : FILTER_EQ, x, rows);
+        for (int r = 0; r < nrows; r++) *hits += rows[r];
+        snprintf(x, sizeof(x), "cliente%d", rand() % 5000);
+        filter_eval(0, FILTER_EQ, x, rows);
+        for (int r = 0; r < nrows; r++) *hits += rows[r];
+    }
+    return now_ms() - t0;
+}
+
+int main(int argc, char **argv) {
+    int queries = argc > 1 ? atoi(argv[1]) : 2000;
+    sheet_new("bench");
+    sheet = sheets[0].cells;
+    fill_sheet();
+
+    double t0 = now_ms();
+    cmd_index("A");
+    cmd_index("B");
+    double build = now_ms() - t0;
+
+    long hits_scan, hits_ix;
+    double scan = run(queries, 0, &hits_scan);
+    double ix = run(queries, 1, &hits_ix);
+
+    // mantenimiento con los índices vivos
+    t0 = now_ms();
+    for (int i = 0; i < queries; i++) {
+        int r = rand() % nrows;
+        snprintf(sheet[r][1].data, CELL_LEN, "%d", rand() % 100000);
+        cell_touch(r, 1);
+    }
+    double edits = now_ms() - t0;
+    t0 = now_ms();
+    for (int i = 0; i < 100; i++) {
+        int r = rand() % (nrows - 1);
+        insert_row(r);
+        remove_row(r);
+    }
+    double shifts = now_ms() - t0;
+
+    printf("filas=%d consultas=%d\n", nrows, queries * 2);
+    printf("construir índices:   %8.2f ms\n", build);
+    printf("recorrido:           %8.2f ms (%ld filas)\n", scan, hits_scan);
+    printf("índice:              %8.2f ms (%ld filas)\n", ix, hits_ix);
+    printf("editar %d celdas:  %8.2f ms\n", queries, edits);
+    printf("insertar/borrar 100: %8.2f ms (incluye mover la hoja)\n", shifts);
+    return hits_scan != hits_ix;
+}
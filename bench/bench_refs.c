@@ -0,0 +1,99 @@
+// Microbenchmarks de los caminos de referencias y nombres: cell_name,
+// col_label, parse_cell y col_from_name. Comprueba primero que dan lo
+// mismo que las versiones anteriores (con sprintf y bucles) y después
+// mide ambas. Uso: bench/bench_refs [iteraciones]
+
+#define main yape_main
+#include "../yape.c"
+#undef main
+
+// --- versiones de referencia ---
+
+static void ref_cell_name(int row, int col, char *buf) {
+    char colname[10];
+    int c = col;
+    int len = 0;
+    do {
+        colname[len++] = 'A' + (c % 26);
+        c = c / 26 - 1;
+    } while (c >= 0);
+    for (int i = 0; i < len; i++)
+        buf[i] = colname[len - 1 - i];
+    sprintf(buf + len, "%d", row + 1);
+}
+
+static int ref_parse_cell(const char *ref, int *row, int *col) {
+    int c = 0, r = 0, i = 0;
+    while (isalpha(ref[i])) {
+        c = c * 26 + (toupper(ref[i]) - 'A' + 1);
+        i++;
+    }
+    c--;
+    while (isdigit(ref[i])) {
+        r = r * 10 + (ref[i] - '0');
+        i++;
+    }
+    r--;
+    if (r < 0 || r >= MAX_ROWS || c < 0 || c >= MAX_COLS) return 0;
+    *row = r; *col = c;
+    return 1;
+}
+
+static int validate() {
+    char a[32], b[32];
+    int bad = 0;
+    for (int col = 0; col < COL_LABELS + 100; col++)
+        for (int row = -3; row < 100000; row += col < 2000 ? 997 : 49999) {
+            cell_name(row, col, a);
+            ref_cell_name(row, col, b);
+            if (strcmp(a, b) != 0 && bad++ < 5) printf("cell_name(%d, %d): %s != %s\n", row, col, a, b);
+        }
+    static const char *refs[] = { "A1", "b7", "Z1000", "AA10", "ALL999", "ALL1000", "ALM1", "A0",
+                                  "1A", "", "A", "ZZZ99", "a1b", "AB12)", "ALK01", "A00012" };
+    for (unsigned k = 0; k < sizeof(refs) / sizeof(refs[0]); k++) {
+        int r1 = -9, c1 = -9, r2 = -9, c2 = -9;
+        int x = parse_cell(refs[k], &r1, &c1), y = ref_parse_cell(refs[k], &r2, &c2);
+        if (x != y || r1 != r2 || c1 != c2) { bad++; printf("parse_cell(%s) distinto\n", refs[k]); }
+    }
+    for (int col = 0; col < MAX_COLS; col++) {
+        char name[16];
+        col_name(col, name);
+        if (col_from_name(name) != col) { bad++; printf("col_from_name(%s) != %d\n", name, col); }
+        int r, c;
+        ref_cell_name(col, col, a);
+        if (!parse_cell(a, &r, &c) || r != col || c != col) { bad++; printf("parse_cell(%s)\n", a); }
+    }
+    return bad;
+}
+
+typedef void (*BenchFn)(int i, volatile int *sink);
+
+static void b_cell_name(int i, volatile int *sink) { char buf[32]; cell_name(i & 1023, i % 700, buf); *sink += buf[1]; }
+static void b_ref_cell_name(int i, volatile int *sink) { char buf[32]; ref_cell_name(i & 1023, i % 700, buf); *sink += buf[1]; }
+static void b_col_label(int i, volatile int *sink) { char buf[8]; *sink += col_label(i % 700, buf); }
+static const char *refs[] = { "A1", "B12", "AA10", "ZZ999", "ALL999", "C3", "Q450", "AB77" };
+static void b_parse_cell(int i, volatile int *sink) { int r, c; *sink += parse_cell(refs[i & 7], &r, &c) + r; }
+static void b_ref_parse_cell(int i, volatile int *sink) { int r, c; *sink += ref_parse_cell(refs[i & 7], &r, &c) + r; }
+static const char *cols[] = { "A", "B", "AA", "ZZ", "ALL", "C", "Q", "AB" };
+static void b_col_from_name(int i, volatile int *sink) { *sink += col_from_name(cols[i & 7]); }
+
+static void run(const char *name, BenchFn fn, int iters) {
+    volatile int sink = 0;
+    double t0 = now_ms();
+    for (int i = 0; i < iters; i++) fn(i, &sink);
+    double ms = now_ms() - t0;
+    printf("%-18s %8.2f ns/llamada\n", name, ms * 1e6 / iters);
+}
+
+int main(int argc, char **argv) {
+    int iters = argc > 1 ? atoi(argv[1]) : 10000000;
+    int bad = validate();
+    printf("validación: %s\n", bad ? "DISTINTO" : "ok");
+    run("cell_name", b_cell_name, iters);
+    run("cell_name (ref)", b_ref_cell_name, iters);
+    run("col_label", b_col_label, iters);
+    run("parse_cell", b_parse_cell, iters);
+    run("parse_cell (ref)", b_ref_parse_cell, iters);
+    run("col_from_name", b_col_from_name, iters);
+    return bad != 0;
+}
@@ -0,0 +1,164 @@
+// Suite de benchmarks de yape sobre un libro (ver gen_workbook.c).
+//
+//   bench_suite libro.csv [-n iteraciones] [-o resultados.json]
+//
+// Mide carga, guardado, recálculo completo, edición + recálculo de lo
+// visible, filtro, insert_row y el coste de dibujar un cuadro (ncurses
+// sobre /dev/null). Escribe los tiempos en JSON para comparar versiones.
+
+#define main yape_main
+#include "../yape.c"
+#undef main
+
+#define BENCH_MAX_SAMPLES 1000
+
+typedef struct {
+    const char *name;
+    int n;
+    double sample[BENCH_MAX_SAMPLES];
+} BenchResult;
+
+static int cmp_sample(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double pct(BenchResult *r, double q) {
+    int i = (int)(q * (r->n - 1) + 0.5);
+    return r->sample[i];
+}
+
+static void bench_json(FILE *f, BenchResult *r, int last) {
+    double sum = 0;
+    qsort(r->sample, r->n, sizeof(double), cmp_sample);
+    for (int i = 0; i < r->n; i++) sum += r->sample[i];
+    fprintf(f, "    \"%s\": {\"iters\": %d, \"mean_ms\": %.4f, \"p50_ms\": %.4f, "
+               "\"p99_ms\": %.4f, \"min_ms\": %.4f, \"max_ms\": %.4f}%s\n",
+            r->name, r->n, sum / r->n, pct(r, 0.5), pct(r, 0.99),
+            r->sample[0], r->sample[r->n - 1], last ? "" : ",");
+}
+
+// Evalúa las fórmulas del rango como lo hace la aplicación: formula_value
+// contra la caché por época, así que el llamador sube sheet_epoch antes
+// (caches_reset o cell_touch) y cada celda se calcula una sola vez
+static double recalc_all(int r0, int r1, int c0, int c1) {
+    double acc = 0;
+    for (int i = r0; i < r1 && i < nrows; i++)
+        for (int j = c0; j < c1 && j < ncols; j++)
+            if (sheet[i][j].data[0] == '=') acc += formula_value(i, j);
+    return acc;
+}
+
+int main(int argc, char **argv) {
+    const char *file = NULL, *out = NULL;
+    int iters = 20;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) iters = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) out = argv[++i];
+        else file = argv[i];
+    }
+    if (!file) {
+        fprintf(stderr, "uso: %s libro.csv [-n iteraciones] [-o resultados.json]\n", argv[0]);
+        return 1;
+    }
+    if (iters < 1) iters = 1;
+    if (iters > BENCH_MAX_SAMPLES) iters = BENCH_MAX_SAMPLES;
+
+    sheet_new("bench");
+    sheet = sheets[0].cells;
+    char tmp[] = "/tmp/yape_benchXXXXXX";
+    int fd = mkstemp(tmp);
+    if (fd >= 0) close(fd);
+
+    enum { B_LOAD, B_SAVE, B_RECALC, B_EDIT, B_FILTER, B_INSERT, B_RENDER, NBENCH };
+    static BenchResult res[NBENCH] = {
+        { "load" }, { "save" }, { "recalc_full" }, { "edit_recalc" },
+        { "filter" }, { "insert_row" }, { "render_frame" },
+    };
+    volatile double sink = 0;
+
+    for (int it = 0; it < iters; it++) {
+        double t0 = now_ms();
+        load_csv(file);
+        res[B_LOAD].sample[res[B_LOAD].n++] = now_ms() - t0;
+    }
+    if (nrows == 0) { fprintf(stderr, "%s: vacío o ilegible\n", file); return 1; }
+
+    for (int it = 0; it < iters; it++) {
+        double t0 = now_ms();
+        save_csv(tmp);
+        res[B_SAVE].sample[res[B_SAVE].n++] = now_ms() - t0;
+    }
+    unlink(tmp);
+
+    for (int it = 0; it < iters; it++) {
+        double t0 = now_ms();
+        caches_reset();
+        sink += recalc_all(0, nrows, 0, ncols);
+        res[B_RECALC].sample[res[B_RECALC].n++] = now_ms() - t0;
+    }
+
+    // una edición y lo que se vuelve a calcular para el cuadro siguiente
+    srand(1);
+    for (int it = 0; it < iters; it++) {
+        int r = rand() % nrows;
+        double t0 = now_ms();
+        snprintf(sheet[r][1].data, CELL_LEN, "%d", rand() % 10000);
+        cell_touch(r, 1);
+        sink += recalc_all(r, r + 40, 0, 13);
+        res[B_EDIT].sample[res[B_EDIT].n++] = now_ms() - t0;
+    }
+
+    for (int it = 0; it < iters; it++) {
+        snprintf(filter_value, sizeof(filter_value), ">%d", rand() % 10000);
+        filter_col = 1;
+        filter_parse();
+        filter_active = 1;
+        filter_epoch = 0;
+        double t0 = now_ms();
+        int n = 0;
+        for (int i = 0; i < nrows; i++) n += filter_matches(i);
+        res[B_FILTER].sample[res[B_FILTER].n++] = now_ms() - t0;
+        sink += n;
+    }
+    filter_active = 0;
+
+    // insertar y deshacer: las fórmulas no se reescriben al desplazar filas
+    for (int it = 0; it < iters && nrows < MAX_ROWS; it++) {
+        int r = rand() % nrows;
+        double t0 = now_ms();
+        insert_row(r);
+        res[B_INSERT].sample[res[B_INSERT].n++] = now_ms() - t0;
+        remove_row(r);
+    }
+
+    // cuadros completos en una terminal sin salida
+    setenv("TERM", "xterm", 0);
+    setenv("LINES", "50", 1);
+    setenv("COLUMNS", "160", 1);
+    FILE *devnull = fopen("/dev/null", "w+");
+    SCREEN *scr = devnull ? newterm(NULL, devnull, devnull) : NULL;
+    if (scr) {
+        for (int it = 0; it < iters; it++) {
+            cur_row = rand() % nrows;
+            caches_reset();
+            double t0 = now_ms();
+            draw_sheet_filtered();
+            res[B_RENDER].sample[res[B_RENDER].n++] = now_ms() - t0;
+        }
+        endwin();
+        delscreen(scr);
+    }
+
+    FILE *f = out ? fopen(out, "w") : stdout;
+    if (!f) { perror(out); return 1; }
+    fprintf(f, "{\n  \"workbook\": \"%s\",\n  \"rows\": %d,\n  \"cols\": %d,\n  \"iters\": %d,\n  \"results\": {\n",
+            file, nrows, ncols, iters);
+    int last = NBENCH - 1;
+    while (last > 0 && res[last].n == 0) last--;
+    for (int b = 0; b <= last; b++)
+        if (res[b].n) bench_json(f, &res[b], b == last);
+    fprintf(f, "  }\n}\n");
+    if (out) fclose(f);
+    return sink == 12345.678;   // evita que se descarten los cálculos
+}
@@ -0,0 +1,92 @@
+// Genera un libro sintético en CSV para los benchmarks.
+//
+//   gen_workbook [-r filas] [-c cols] [-f densidad] [-d profundidad]
+//                [-o fan-out] [-k cardinalidad] [-s semilla] > libro.csv
+//
+// Columnas: A es un id; las de índice c % 4 == 1 son números base; las
+// c % 4 == 2 texto con k valores distintos (si k > 0); el resto números o,
+// con probabilidad densidad, fórmulas. Cada fórmula suma la celda de
+// arriba (cadenas de hasta d fórmulas) y fan-out - 1 celdas base al azar,
+// así el coste de evaluar queda acotado por d * fan-out.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CELL_LEN 64
+
+static void col_name(int col, char *buf) {
+    char tmp[8];
+    int n = 0;
+    col++;
+    while (col > 0) {
+        tmp[n++] = 'A' + (col - 1) % 26;
+        col = (col - 1) / 26;
+    }
+    for (int i = 0; i < n; i++) buf[i] = tmp[n - 1 - i];
+    buf[n] = '\0';
+}
+
+int main(int argc, char **argv) {
+    int rows = 1000, cols = 20, depth = 4, fanout = 3, card = 50;
+    double density = 0.3;
+    unsigned seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:c:f:d:o:k:s:")) != -1) {
+        switch (opt) {
+            case 'r': rows = atoi(optarg); break;
+            case 'c': cols = atoi(optarg); break;
+            case 'f': density = atof(optarg); break;
+            case 'd': depth = atoi(optarg); break;
+            case 'o': fanout = atoi(optarg); break;
+            case 'k': card = atoi(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            default:
+                fprintf(stderr, "uso: %s [-r filas] [-c cols] [-f densidad] [-d profundidad] "
+                                "[-o fan-out] [-k cardinalidad] [-s semilla]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (cols < 2) cols = 2;
+    if (depth < 1) depth = 1;
+    if (fanout < 1) fanout = 1;
+    if (fanout > 6) fanout = 6;      // la fórmula debe caber en una celda
+    srand(seed);
+
+    int nbase = 0;
+    for (int c = 1; c < cols; c++) if (c % 4 == 1) nbase++;
+
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            char cell[CELL_LEN];
+            if (c == 0) {
+                snprintf(cell, sizeof(cell), "%d", r + 1);
+            } else if (c % 4 == 1) {
+                snprintf(cell, sizeof(cell), "%d", rand() % 10000);
+            } else if (c % 4 == 2 && card > 0) {
+                snprintf(cell, sizeof(cell), "s%d", rand() % card);
+            } else if ((double)rand() / RAND_MAX < density) {
+                int len = snprintf(cell, sizeof(cell), "=");
+                char ref[16];
+                int nrefs = 0;
+                if (r % depth != 0) {
+                    col_name(c, ref);
+                    len += snprintf(cell + len, sizeof(cell) - len, "%s%d", ref, r);
+                    nrefs++;
+                }
+                for (; nrefs < fanout; nrefs++) {
+                    int bc = 1 + 4 * (rand() % nbase);
+                    col_name(bc, ref);
+                    len += snprintf(cell + len, sizeof(cell) - len, "%s%s%d",
+                                    nrefs ? "+" : "", ref, 1 + rand() % rows);
+                }
+            } else {
+                snprintf(cell, sizeof(cell), "%.2f", (rand() % 100000) / 100.0);
+            }
+            fputs(cell, stdout);
+            putchar(c < cols - 1 ? ',' : '\n');
+        }
+    }
+    return 0;
+}
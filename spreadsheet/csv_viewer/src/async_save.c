@@ -0,0 +1,136 @@
+#include "async_save.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define WBUF_SIZE 65536
+
+// progreso compartido entre el proceso hijo (escritor) y la UI
+typedef struct {
+    volatile int rows_done;
+    volatile int total_rows;
+} SaveProgress;
+
+static SaveProgress *progress = NULL;
+static pid_t save_pid = -1;
+
+static int flush_buf(int fd, char *buf, int *len) {
+    int off = 0;
+    while (off < *len) {
+        ssize_t n = write(fd, buf + off, *len - off);
+        if (n < 0) return -1;
+        off += n;
+    }
+    *len = 0;
+    return 0;
+}
+
+// Escribe la hoja en fd. Solo usa write(): se llama tambien desde el hijo
+// tras fork(), donde stdio no es seguro.
+static int write_sheet(int fd, const Sheet *sheet, SaveProgress *prog) {
+    static char buf[WBUF_SIZE];
+    int len = 0;
+
+    for (int i = 0; i < sheet->nrows; i++) {
+        for (int j = 0; j < sheet->ncols; j++) {
+            const char *s = sheet->cells[i][j].data;
+            int n = strnlen(s, CELL_LEN);
+            if (len + n + 2 > WBUF_SIZE && flush_buf(fd, buf, &len) < 0) return -1;
+            memcpy(buf + len, s, n);
+            len += n;
+            if (j < sheet->ncols - 1) buf[len++] = ',';
+        }
+        buf[len++] = '\n';
+        if (prog) prog->rows_done = i + 1;
+    }
+    if (flush_buf(fd, buf, &len) < 0) return -1;
+    return fsync(fd);
+}
+
+// Archivo temporal en el mismo directorio para que rename() sea atomico
+static int open_temp(const char *filename, char *tmpname, size_t size) {
+    snprintf(tmpname, size, "%s.tmpXXXXXX", filename);
+    return mkstemp(tmpname);
+}
+
+static int save_to(const Sheet *sheet, const char *filename, SaveProgress *prog) {
+    char tmpname[1024];
+    int fd = open_temp(filename, tmpname, sizeof(tmpname));
+    if (fd < 0) return -1;
+    // mkstemp crea con 0600: conservar los permisos del archivo original
+    struct stat st;
+    fchmod(fd, stat(filename, &st) == 0 ? (st.st_mode & 07777) : 0644);
+
+    if (write_sheet(fd, sheet, prog) < 0) {
+        close(fd);
+        unlink(tmpname);
+        return -1;
+    }
+    if (close(fd) < 0 || rename(tmpname, filename) < 0) {
+        unlink(tmpname);
+        return -1;
+    }
+    return 0;
+}
+
+int save_csv(const Sheet *sheet, const char *filename) {
+    return save_to(sheet, filename, NULL);
+}
+
+// Guardado en segundo plano: fork() da al hijo una copia copy-on-write de
+// la hoja, asi la UI puede seguir editando mientras se escribe el snapshot.
+// Devuelve 0 si arranco (o si el guardado sincrono de respaldo salio bien),
+// 1 si ya habia uno en curso y -1 si el guardado sincrono fallo.
+int save_csv_async(const Sheet *sheet, const char *filename) {
+    if (save_pid > 0) return 1;  // ya hay un guardado en curso
+
+    if (!progress) {
+        progress = mmap(NULL, sizeof(SaveProgress), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (progress == MAP_FAILED) {
+            progress = NULL;
+            return save_csv(sheet, filename);
+        }
+    }
+    progress->rows_done = 0;
+    progress->total_rows = sheet->nrows;
+
+    pid_t pid = fork();
+    if (pid < 0) return save_csv(sheet, filename);
+    if (pid == 0) _exit(save_to(sheet, filename, progress) == 0 ? 0 : 1);
+
+    save_pid = pid;
+    return 0;
+}
+
+int save_poll(int *percent) {
+    if (save_pid <= 0) return SAVE_IDLE;
+
+    int status;
+    pid_t r = waitpid(save_pid, &status, WNOHANG);
+    if (r == 0) {
+        if (percent) {
+            int total = progress->total_rows;
+            *percent = total > 0 ? (int)(100LL * progress->rows_done / total) : 0;
+        }
+        return SAVE_RUNNING;
+    }
+
+    save_pid = -1;
+    if (percent) *percent = 100;
+    if (r < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return SAVE_FAILED;
+    return SAVE_DONE;
+}
+
+// Espera a que termine un guardado pendiente (al salir)
+void save_wait(void) {
+    if (save_pid <= 0) return;
+    int status;
+    waitpid(save_pid, &status, 0);
+    save_pid = -1;
+}
@@ -0,0 +1,17 @@
+#ifndef ASYNC_SAVE_H
+#define ASYNC_SAVE_H
+
+#include "csv_reader.h"
+
+// estados de un guardado en segundo plano
+#define SAVE_IDLE    0
+#define SAVE_RUNNING 1
+#define SAVE_DONE    2
+#define SAVE_FAILED  3
+
+int save_csv(const Sheet *sheet, const char *filename);
+int save_csv_async(const Sheet *sheet, const char *filename);
+int save_poll(int *percent);
+void save_wait(void);
+
+#endif
@@ -28,7 +28,10 @@ int load_csv(const char *filename, Sheet *sheet) {
         if (row >= MAX_ROWS) break;
     }
 
+    // quedan filas que no caben en la hoja
+    int truncated = row >= MAX_ROWS && fgets(line, sizeof(line), fp) != NULL;
+
     sheet->nrows = row;
     fclose(fp);
-    return 0;
+    return truncated ? 1 : 0;
 }
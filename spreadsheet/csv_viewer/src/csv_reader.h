@@ -15,6 +15,7 @@ typedef struct {
     int ncols;
 } Sheet;
 
+// 0: ok, 1: el archivo tiene más de MAX_ROWS filas, -1: error
 int load_csv(const char *filename, Sheet *sheet);
 
 #endif
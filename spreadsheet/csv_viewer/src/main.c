@@ -4,11 +4,32 @@
 #include <stdlib.h>
 #include <string.h>
 
+static int run_indexed(const char *filename, int follow) {
+    RowIndex *ix = row_index_open(filename, INDEX_STEP, follow);
+    if (!ix) {
+        perror("Error al abrir archivo CSV");
+        return 1;
+    }
+    display_indexed(ix, filename);
+    row_index_close(ix);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Uso: %s archivo.csv\n", argv[0]);
+    int indexed = 0, follow = 0;
+    const char *filename = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-x") == 0) indexed = 1;
+        else if (strcmp(argv[i], "-f") == 0) follow = 1;
+        else filename = argv[i];
+    }
+    if (!filename) {
+        printf("Uso: %s [-x] [-f] archivo.csv\n", argv[0]);
+        printf("  -x  modo índice para archivos grandes (solo lectura)\n");
+        printf("  -f  seguir el archivo mientras crece (implica -x)\n");
         return 1;
     }
+    if (indexed || follow) return run_indexed(filename, follow);
 
     Sheet *sheet = malloc(sizeof(Sheet));
     if (!sheet) {
@@ -17,12 +38,18 @@ int main(int argc, char *argv[]) {
     }
     memset(sheet, 0, sizeof(Sheet));
 
-    if (load_csv(argv[1], sheet) != 0) {
+    int r = load_csv(filename, sheet);
+    if (r < 0) {
         free(sheet);
         return 1;
     }
+    if (r == 1) {
+        // no cabe en la hoja: abrir en modo índice
+        free(sheet);
+        return run_indexed(filename, 0);
+    }
 
-    display_sheet(sheet, argv[1]);  // pasamos el nombre del archivo
+    display_sheet(sheet, filename);  // pasamos el nombre del archivo
     free(sheet);
     return 0;
 }
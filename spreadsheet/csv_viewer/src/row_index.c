@@ -0,0 +1,483 @@
+#include "row_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+
+#define SCAN_BUF (1 << 20)
+
+static int add_offset(RowIndex *ix, off_t off) {
+    if (ix->noffsets == ix->cap) {
+        long long cap = ix->cap ? ix->cap * 2 : 1024;
+        off_t *p = realloc(ix->offsets, cap * sizeof(off_t));
+        if (!p) return -1;
+        ix->offsets = p;
+        ix->cap = cap;
+    }
+    ix->offsets[ix->noffsets++] = off;
+    return 0;
+}
+
+// --- caché del índice en disco (archivo.csv.msidx) ---
+
+#define MSIDX_MAGIC "MSIDX\0\0\1"
+#define HASH_SAMPLE 65536
+
+typedef struct {
+    char magic[8];
+    int32_t step;
+    int32_t reserved;
+    int64_t size;          // bytes indexados
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t head_hash;    // primeros HASH_SAMPLE bytes
+    uint64_t tail_hash;    // últimos HASH_SAMPLE bytes antes de size
+    int64_t resume_off;    // inicio del registro incompleto (o size)
+    int64_t resume_rows;   // filas completas antes de resume_off
+    int64_t noffsets;
+} IndexCacheHeader;
+
+static void cache_name(const RowIndex *ix, char *buf, size_t size) {
+    snprintf(buf, size, "%s.msidx", ix->filename);
+}
+
+// FNV-1a de un tramo del archivo
+static uint64_t sample_hash(int fd, off_t off, off_t len) {
+    unsigned char buf[4096];
+    uint64_t h = 1469598103934665603ULL;
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len < (off_t)sizeof(buf) ? len : (off_t)sizeof(buf), off);
+        if (n <= 0) break;
+        for (ssize_t i = 0; i < n; i++) { h ^= buf[i]; h *= 1099511628211ULL; }
+        off += n;
+        len -= n;
+    }
+    return h;
+}
+
+static uint64_t head_hash(int fd, off_t size) {
+    return sample_hash(fd, 0, size < HASH_SAMPLE ? size : HASH_SAMPLE);
+}
+
+static uint64_t tail_hash(int fd, off_t size) {
+    off_t len = size < HASH_SAMPLE ? size : HASH_SAMPLE;
+    return sample_hash(fd, size - len, len);
+}
+
+static void index_cache_save(RowIndex *ix, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return;
+
+    IndexCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MSIDX_MAGIC, 8);
+    h.step = ix->step;
+    h.size = ix->scanned;
+    h.mtime_sec = st.st_mtim.tv_sec;
+    h.mtime_nsec = st.st_mtim.tv_nsec;
+    h.head_hash = head_hash(fd, h.size);
+    h.tail_hash = tail_hash(fd, h.size);
+    h.resume_off = ix->at_start ? ix->scanned : ix->rec_start;
+    h.resume_rows = ix->complete_rows;
+    // solo los puntos de filas completas; el registro abierto se reescanea
+    h.noffsets = (h.resume_rows + ix->step - 1) / ix->step;
+
+    char name[1100], tmp[1200];
+    cache_name(ix, name, sizeof(name));
+    snprintf(tmp, sizeof(tmp), "%s.tmpXXXXXX", name);
+    int out = mkstemp(tmp);
+    if (out < 0) return;
+    fchmod(out, 0644);
+
+    pthread_mutex_lock(&ix->lock);
+    int ok = write(out, &h, sizeof(h)) == sizeof(h) &&
+             write(out, ix->offsets, h.noffsets * sizeof(off_t)) == (ssize_t)(h.noffsets * sizeof(off_t));
+    pthread_mutex_unlock(&ix->lock);
+
+    if (close(out) < 0 || !ok || rename(tmp, name) < 0) unlink(tmp);
+}
+
+// Devuelve 1 si el índice está completo, 0 si hay que seguir escaneando
+// (desde ix->scanned), y -1 si no hay caché utilizable. La caché sirve tal
+// cual si tamaño y mtime coinciden; si el archivo solo creció y las
+// muestras del principio y del final de lo indexado siguen iguales, se
+// toma como un agregado al final. Cualquier otro cambio (mismo tamaño con
+// otro mtime, archivo más corto) obliga a reescanear.
+static int index_cache_load(RowIndex *ix, const struct stat *st) {
+    char name[1100];
+    cache_name(ix, name, sizeof(name));
+    FILE *fp = fopen(name, "rb");
+    if (!fp) return -1;
+
+    IndexCacheHeader h;
+    int fd = open(ix->filename, O_RDONLY);
+    int valid = fd >= 0 && fread(&h, sizeof(h), 1, fp) == 1 &&
+                memcmp(h.magic, MSIDX_MAGIC, 8) == 0 && h.step == ix->step &&
+                h.resume_off <= h.size && h.noffsets >= 0;
+    int unchanged = valid && h.size == st->st_size &&
+                    h.mtime_sec == st->st_mtim.tv_sec && h.mtime_nsec == st->st_mtim.tv_nsec;
+    int appended = valid && h.size < st->st_size;
+    valid = (unchanged || appended) &&
+            head_hash(fd, h.size) == h.head_hash && tail_hash(fd, h.size) == h.tail_hash;
+    if (fd >= 0) close(fd);
+
+    if (valid) {
+        ix->offsets = malloc((h.noffsets ? h.noffsets : 1) * sizeof(off_t));
+        valid = ix->offsets && fread(ix->offsets, sizeof(off_t), h.noffsets, fp) == (size_t)h.noffsets;
+    }
+    fclose(fp);
+    if (!valid) {
+        free(ix->offsets);
+        ix->offsets = NULL;
+        return -1;
+    }
+    ix->noffsets = ix->cap = h.noffsets;
+    ix->complete_rows = h.resume_rows;
+
+    if (unchanged) {
+        // nada que escanear: el registro abierto (si lo hay) cuenta como fila
+        ix->scanned = h.size;
+        ix->at_start = h.resume_off == h.size;
+        ix->rec_start = h.resume_off;
+        if (!ix->at_start && h.resume_rows % ix->step == 0 && add_offset(ix, h.resume_off) < 0) {
+            free(ix->offsets);
+            ix->offsets = NULL;
+            ix->noffsets = ix->cap = 0;
+            return -1;
+        }
+        ix->nrows = h.resume_rows + !ix->at_start;
+        return 1;
+    }
+
+    // agregado al final: retomar desde el último registro completo
+    ix->scanned = h.resume_off;
+    ix->at_start = 1;
+    ix->nrows = h.resume_rows;
+    return 0;
+}
+
+// --- agregados por columna (modo -f) ---
+
+static void agg_record(RowIndex *ix, const char *rec, size_t len) {
+    char field[CELL_LEN];
+    int col = 0, flen = 0, in_quotes = 0;
+
+    pthread_mutex_lock(&ix->lock);
+    for (size_t i = 0; i <= len; i++) {
+        char c = i < len ? rec[i] : ',';
+        if (c == '"') { in_quotes = !in_quotes; continue; }
+        if ((c == ',' && !in_quotes) || i == len) {
+            field[flen] = '\0';
+            char *end;
+            double v = strtod(field, &end);
+            if (flen > 0 && *end == '\0' && col < MAX_COLS) {
+                ColAgg *a = &ix->agg[col];
+                if (a->count == 0 || v < a->min) a->min = v;
+                if (a->count == 0 || v > a->max) a->max = v;
+                a->sum += v;
+                a->count++;
+            }
+            col++;
+            flen = 0;
+        } else if (c != '\r' && c != '\n' && flen < CELL_LEN - 1) {
+            field[flen++] = c;
+        }
+    }
+    pthread_mutex_unlock(&ix->lock);
+}
+
+static void carry_append(RowIndex *ix, const char *p, size_t len) {
+    if (ix->carry_len + len > ix->carry_cap) {
+        size_t cap = ix->carry_cap ? ix->carry_cap : 4096;
+        while (cap < ix->carry_len + len) cap *= 2;
+        char *nc = realloc(ix->carry, cap);
+        if (!nc) return;
+        ix->carry = nc;
+        ix->carry_cap = cap;
+    }
+    memcpy(ix->carry + ix->carry_len, p, len);
+    ix->carry_len += len;
+}
+
+// Continúa el escaneo desde ix->scanned hasta EOF. El estado (comillas,
+// inicio del registro en curso) queda en ix, así se puede retomar luego.
+// Los saltos de línea dentro de comillas no terminan el registro. Con
+// ix->aggregate, cada registro completo actualiza los agregados; los bytes
+// de un registro cortado al final del bloque esperan en ix->carry.
+static void scan_more(RowIndex *ix, int fd, char *buf) {
+    off_t pos = ix->scanned;
+    long long rows = ix->complete_rows;
+    int in_quotes = ix->in_quotes;
+    int at_start = ix->at_start;
+    off_t rec_start = ix->rec_start;
+    ssize_t n;
+
+    while (!ix->cancel && !ix->failed && (n = pread(fd, buf, SCAN_BUF, pos)) > 0) {
+        ssize_t rec_i = 0;   // inicio del registro actual dentro de buf
+        for (ssize_t i = 0; i < n; i++) {
+            if (at_start) {
+                rec_start = pos + i;
+                rec_i = i;
+                if (rows % ix->step == 0) {
+                    pthread_mutex_lock(&ix->lock);
+                    int err = add_offset(ix, rec_start);
+                    pthread_mutex_unlock(&ix->lock);
+                    if (err < 0) {
+                        // sin el punto k*step los siguientes quedarían corridos:
+                        // el índice se queda en las filas ya contadas
+                        pthread_mutex_lock(&ix->lock);
+                        ix->failed = 1;
+                        ix->complete_rows = ix->nrows = rows;
+                        ix->scanned = rec_start;
+                        pthread_mutex_unlock(&ix->lock);
+                        ix->at_start = 1;
+                        return;
+                    }
+                }
+                at_start = 0;
+            }
+            char c = buf[i];
+            if (c == '"') in_quotes = !in_quotes;
+            else if (c == '\n' && !in_quotes) {
+                if (ix->aggregate) {
+                    if (ix->carry_len) {
+                        carry_append(ix, buf, i);
+                        agg_record(ix, ix->carry, ix->carry_len);
+                        ix->carry_len = 0;
+                    } else {
+                        agg_record(ix, buf + rec_i, i - rec_i);
+                    }
+                }
+                rows++;
+                at_start = 1;
+            }
+        }
+        if (ix->aggregate && !at_start) carry_append(ix, buf + rec_i, n - rec_i);
+        pos += n;
+        pthread_mutex_lock(&ix->lock);
+        ix->complete_rows = rows;
+        ix->nrows = rows + !at_start;   // última fila sin '\n'
+        ix->scanned = pos;
+        if (pos > ix->file_size) ix->file_size = pos;
+        pthread_mutex_unlock(&ix->lock);
+    }
+
+    ix->in_quotes = in_quotes;
+    ix->at_start = at_start;
+    ix->rec_start = rec_start;
+}
+
+// Vuelve a indexar desde el principio (archivo truncado o reemplazado)
+static void index_reset(RowIndex *ix, off_t size) {
+    pthread_mutex_lock(&ix->lock);
+    ix->noffsets = 0;
+    ix->nrows = ix->complete_rows = 0;
+    ix->scanned = 0;
+    ix->file_size = size;
+    ix->in_quotes = 0;
+    ix->at_start = 1;
+    ix->rec_start = 0;
+    ix->carry_len = 0;
+    memset(ix->agg, 0, sizeof(ix->agg));
+    pthread_mutex_unlock(&ix->lock);
+}
+
+#define FOLLOW_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB)
+
+// Espera con inotify a que el archivo crezca y escanea solo lo añadido. Si
+// se trunca se reindexa desde el principio; si se rota (el nombre pasa a
+// ser otro archivo) se abre el nuevo y se indexa entero.
+static void follow_file(RowIndex *ix, int *fd, char *buf) {
+    int in = inotify_init1(IN_NONBLOCK);
+    if (in < 0) return;
+    int wd = inotify_add_watch(in, ix->filename, FOLLOW_EVENTS);
+    if (wd < 0) {
+        close(in);
+        return;
+    }
+    // lo añadido entre el escaneo inicial y el watch no genera evento
+    scan_more(ix, *fd, buf);
+
+    char ev[4096];
+    while (!ix->cancel && !ix->failed) {
+        struct pollfd pfd = { in, POLLIN, 0 };
+        if (poll(&pfd, 1, 200) > 0)
+            while (read(in, ev, sizeof(ev)) > 0) ;
+
+        struct stat cur, named;
+        if (stat(ix->filename, &named) == 0 && fstat(*fd, &cur) == 0 &&
+            (named.st_ino != cur.st_ino || named.st_dev != cur.st_dev)) {
+            int nfd = open(ix->filename, O_RDONLY);
+            if (nfd >= 0) {
+                close(*fd);
+                *fd = nfd;
+                inotify_rm_watch(in, wd);
+                wd = inotify_add_watch(in, ix->filename, FOLLOW_EVENTS);
+                index_reset(ix, named.st_size);
+            }
+        } else if (fstat(*fd, &cur) == 0 && cur.st_size < ix->scanned) {
+            index_reset(ix, cur.st_size);
+        }
+        scan_more(ix, *fd, buf);
+    }
+    close(in);
+}
+
+static void *scan_thread(void *arg) {
+    RowIndex *ix = arg;
+    int fd = open(ix->filename, O_RDONLY);
+    char *buf = malloc(SCAN_BUF);
+    if (fd >= 0 && buf) {
+        scan_more(ix, fd, buf);
+        if (!ix->cancel && !ix->failed) index_cache_save(ix, fd);
+    }
+
+    pthread_mutex_lock(&ix->lock);
+    ix->done = 1;
+    pthread_mutex_unlock(&ix->lock);
+
+    if (fd >= 0 && buf && ix->follow && !ix->failed) {
+        follow_file(ix, &fd, buf);
+        index_cache_save(ix, fd);
+    }
+    if (fd >= 0) close(fd);
+    free(buf);
+    return NULL;
+}
+
+RowIndex *row_index_open(const char *filename, int step, int follow) {
+    struct stat st;
+    if (stat(filename, &st) < 0) return NULL;
+
+    RowIndex *ix = calloc(1, sizeof(RowIndex));
+    if (!ix) return NULL;
+    snprintf(ix->filename, sizeof(ix->filename), "%s", filename);
+    ix->step = step > 0 ? step : INDEX_STEP;
+    ix->file_size = st.st_size;
+    ix->at_start = 1;
+    ix->follow = follow;
+    ix->aggregate = follow;
+    pthread_mutex_init(&ix->lock, NULL);
+
+    // en modo -f los agregados necesitan recorrer el archivo entero, así
+    // que no se parte del caché (se guarda igual al terminar)
+    int cached = follow ? -1 : index_cache_load(ix, &st);
+    ix->from_cache = cached >= 0;
+    if (cached == 1 && !follow) {
+        ix->done = 1;   // archivo sin cambios: no hace falta escanear
+        return ix;
+    }
+
+    if (pthread_create(&ix->thread, NULL, scan_thread, ix) != 0) {
+        pthread_mutex_destroy(&ix->lock);
+        free(ix->offsets);
+        free(ix);
+        return NULL;
+    }
+    ix->has_thread = 1;
+    return ix;
+}
+
+int row_index_agg(RowIndex *ix, int col, ColAgg *out) {
+    if (col < 0 || col >= MAX_COLS) return 0;
+    pthread_mutex_lock(&ix->lock);
+    *out = ix->agg[col];
+    pthread_mutex_unlock(&ix->lock);
+    return out->count > 0;
+}
+
+long long row_index_rows(RowIndex *ix, int *done, int *percent) {
+    pthread_mutex_lock(&ix->lock);
+    long long rows = ix->nrows;
+    if (done) *done = ix->done;
+    if (percent) *percent = ix->file_size > 0 ? (int)(100 * ix->scanned / ix->file_size) : 100;
+    pthread_mutex_unlock(&ix->lock);
+    return rows;
+}
+
+// Lee un registro (con soporte de comillas) en row. Devuelve 0 en EOF.
+static int read_record(FILE *fp, Cell *row, int *ncols) {
+    int c = getc(fp);
+    if (c == EOF) return 0;
+
+    int col = 0, len = 0, in_quotes = 0;
+    char *cell = row[0].data;
+    for (; c != EOF; c = getc(fp)) {
+        if (in_quotes) {
+            if (c == '"') {
+                int next = getc(fp);
+                if (next == '"') { if (col < MAX_COLS && len < CELL_LEN - 1) cell[len++] = '"'; }
+                else { in_quotes = 0; ungetc(next, fp); }
+            } else if (col < MAX_COLS && len < CELL_LEN - 1) cell[len++] = (c == '\n' || c == '\r') ? ' ' : c;
+        } else if (c == '"') {
+            in_quotes = 1;
+        } else if (c == ',' || c == '\n') {
+            if (col < MAX_COLS) cell[len] = '\0';
+            if (c == '\n') break;
+            col++;
+            len = 0;
+            cell = col < MAX_COLS ? row[col].data : row[MAX_COLS - 1].data;
+        } else if (c != '\r' && col < MAX_COLS && len < CELL_LEN - 1) {
+            cell[len++] = c;
+        }
+    }
+    if (c == EOF && col < MAX_COLS) cell[len] = '\0';
+    *ncols = col + 1 < MAX_COLS ? col + 1 : MAX_COLS;
+    return 1;
+}
+
+static int skip_record(FILE *fp) {
+    int c, in_quotes = 0, any = 0;
+    while ((c = getc(fp)) != EOF) {
+        any = 1;
+        if (c == '"') in_quotes = !in_quotes;
+        else if (c == '\n' && !in_quotes) return 1;
+    }
+    return any;
+}
+
+// Parsea solo las filas [first, first+count) en window, partiendo del punto
+// de índice más cercano. Devuelve el número de filas leídas.
+int row_index_read(RowIndex *ix, long long first, int count, Sheet *window) {
+    if (count > MAX_ROWS) count = MAX_ROWS;
+
+    pthread_mutex_lock(&ix->lock);
+    long long k = first / ix->step;
+    if (k >= ix->noffsets) k = ix->noffsets - 1;
+    off_t off = k >= 0 ? ix->offsets[k] : 0;
+    pthread_mutex_unlock(&ix->lock);
+    long long row = k >= 0 ? k * ix->step : 0;
+
+    FILE *fp = fopen(ix->filename, "r");
+    if (!fp) return 0;
+    fseeko(fp, off, SEEK_SET);
+    while (row < first && skip_record(fp)) row++;
+
+    int n = 0;
+    window->ncols = 0;
+    while (n < count) {
+        int nc = 0;
+        memset(window->cells[n], 0, sizeof(Cell) * MAX_COLS);
+        if (!read_record(fp, window->cells[n], &nc)) break;
+        if (nc > window->ncols) window->ncols = nc;
+        n++;
+    }
+    window->nrows = n;
+    fclose(fp);
+    return n;
+}
+
+void row_index_close(RowIndex *ix) {
+    if (!ix) return;
+    ix->cancel = 1;
+    if (ix->has_thread) pthread_join(ix->thread, NULL);
+    pthread_mutex_destroy(&ix->lock);
+    free(ix->offsets);
+    free(ix->carry);
+    free(ix);
+}
@@ -0,0 +1,57 @@
+#ifndef ROW_INDEX_H
+#define ROW_INDEX_H
+
+#include "csv_reader.h"
+#include <pthread.h>
+#include <sys/types.h>
+
+#define INDEX_STEP 1024
+
+// Agregados numéricos de una columna, actualizados a medida que se escanea
+typedef struct {
+    long long count;
+    double sum;
+    double min;
+    double max;
+} ColAgg;
+
+// Índice disperso de inicios de registro: offsets[k] es el byte donde empieza
+// la fila k*step. Lo construye un hilo en segundo plano y se guarda junto al
+// archivo (archivo.csv.msidx) para no reescanear al reabrirlo.
+typedef struct {
+    char filename[1024];
+    int step;
+    off_t *offsets;
+    long long noffsets;
+    long long cap;
+    long long nrows;        // filas contadas hasta ahora
+    off_t scanned;          // bytes ya escaneados
+    off_t file_size;
+    // estado del escáner, para poder retomarlo
+    long long complete_rows;
+    int in_quotes;
+    int at_start;
+    off_t rec_start;
+    int from_cache;         // se partió de archivo.msidx
+    // modo -f: seguir el archivo y mantener agregados
+    int follow;
+    int aggregate;
+    ColAgg agg[MAX_COLS];
+    char *carry;            // bytes del registro incompleto al final del bloque
+    size_t carry_len;
+    size_t carry_cap;
+    int has_thread;
+    int done;
+    int failed;             // sin memoria para el índice: se quedó a medias
+    volatile int cancel;
+    pthread_mutex_t lock;
+    pthread_t thread;
+} RowIndex;
+
+RowIndex *row_index_open(const char *filename, int step, int follow);
+long long row_index_rows(RowIndex *ix, int *done, int *percent);
+int row_index_agg(RowIndex *ix, int col, ColAgg *out);
+int row_index_read(RowIndex *ix, long long first, int count, Sheet *window);
+void row_index_close(RowIndex *ix);
+
+#endif
@@ -1,8 +1,10 @@
 #include "ui.h"
 #include "undo.h"
+#include "async_save.h"
 #include <ncurses.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #define COL_WIDTH 15
 
@@ -41,23 +43,6 @@ void edit_cell(Sheet *sheet, int row, int col) {
     curs_set(0);
 }
 
-void save_csv(Sheet *sheet, const char *filename) {
-    FILE *fp = fopen(filename, "w");
-    if (!fp) {
-        mvprintw(0,0,"Error al guardar CSV");
-        return;
-    }
-
-    for (int i = 0; i < sheet->nrows; i++) {
-        for (int j = 0; j < sheet->ncols; j++) {
-            fprintf(fp, "%s", sheet->cells[i][j].data);
-            if (j < sheet->ncols - 1) fprintf(fp, ",");
-        }
-        fprintf(fp, "\n");
-    }
-    fclose(fp);
-}
-
 void display_sheet(Sheet *sheet, const char *filename) {
     initscr();
     cbreak();
@@ -73,6 +58,7 @@ void display_sheet(Sheet *sheet, const char *filename) {
 
     int max_visible_cols = (max_x - COL_WIDTH) / COL_WIDTH;
     int max_visible_rows = max_y - 1;
+    char status[128] = "";
 
     while (1) {
         clear();
@@ -102,9 +88,22 @@ void display_sheet(Sheet *sheet, const char *filename) {
             }
         }
 
-        mvprintw(max_y-1, 0, "jklh: mover | i: editar | s: guardar | u: undo | Ctrl+R: redo | q: salir");
+        // progreso del guardado en segundo plano
+        int pct = 0;
+        int st = save_poll(&pct);
+        if (st == SAVE_RUNNING) snprintf(status, sizeof(status), "Guardando... %d%%", pct);
+        else if (st == SAVE_DONE) snprintf(status, sizeof(status), "CSV guardado correctamente!");
+        else if (st == SAVE_FAILED) snprintf(status, sizeof(status), "Error al guardar CSV");
+        if (status[0]) mvprintw(max_y-2, 0, "%s", status);
+
+        mvprintw(max_y-1, 0, "jklh: mover | i: editar | s: guardar | u: undo | Ctrl+R: redo | m: memoria | q: salir");
         refresh();
+
+        // mientras se guarda no bloquear en getch para refrescar el progreso
+        timeout(st == SAVE_RUNNING ? 100 : -1);
         ch = getch();
+        if (ch == ERR) continue;
+        status[0] = '\0';
 
         if (ch == 'q') break;
         else if (ch == 'j' && active_row < sheet->nrows - 1) active_row++;
@@ -115,9 +114,9 @@ void display_sheet(Sheet *sheet, const char *filename) {
             edit_cell(sheet, active_row, active_col);
         }
         else if (ch == 's') {
-            save_csv(sheet, filename);
-            mvprintw(max_y-2, 0, "CSV guardado correctamente!");
-            refresh();
+            int r = save_csv_async(sheet, filename);
+            if (r == 1) snprintf(status, sizeof(status), "Ya hay un guardado en curso");
+            else if (r < 0) snprintf(status, sizeof(status), "Error al guardar CSV");
         }
         else if (ch == 'u') {
             if (perform_undo(sheet)) {
@@ -127,6 +126,21 @@ void display_sheet(Sheet *sheet, const char *filename) {
             }
             refresh();
         }
+        else if (ch == 'm') {
+            // memoria: la hoja y las pilas de undo son reservas fijas
+            long long used = 0, live = 0;
+            for (int i = 0; i < sheet->nrows; i++)
+                for (int j = 0; j < sheet->ncols; j++)
+                    if (sheet->cells[i][j].data[0]) {
+                        used += strlen(sheet->cells[i][j].data) + 1;
+                        live++;
+                    }
+            int actions;
+            size_t undo = undo_memory(&actions);
+            snprintf(status, sizeof(status), "Hoja %zu KB (%lld celdas, %lld B de texto, %.0f B/celda) | undo %zu KB (%d acciones)",
+                     sizeof(Sheet) / 1024, live, used, live ? (double)sizeof(Sheet) / live : 0.0,
+                     undo / 1024, actions);
+        }
         else if (ch == 18) { // Ctrl+R
             if (perform_redo(sheet)) {
                 mvprintw(max_y-2, 0, "Redo realizado!");
@@ -145,5 +159,96 @@ void display_sheet(Sheet *sheet, const char *filename) {
         else if (active_col >= start_col + max_visible_cols) start_col = active_col - max_visible_cols + 1;
     }
 
+    save_wait();
+    endwin();
+}
+
+// Modo índice: solo lectura, parsea únicamente las filas visibles
+void display_indexed(RowIndex *ix, const char *filename) {
+    Sheet *window = malloc(sizeof(Sheet));
+    if (!window) return;
+    memset(window, 0, sizeof(Sheet));
+
+    initscr();
+    cbreak();
+    noecho();
+    keypad(stdscr, TRUE);
+    curs_set(0);
+
+    int ch, last_ch = 0;
+    int following = ix->follow;   // la vista sigue al final del archivo
+    long long start_row = 0, active_row = 0;
+    int start_col = 0, active_col = 0;
+    int max_y, max_x;
+    getmaxyx(stdscr, max_y, max_x);
+
+    int max_visible_cols = (max_x - COL_WIDTH) / COL_WIDTH;
+    int max_visible_rows = max_y - 3;
+
+    while (1) {
+        int done, pct;
+        long long total = row_index_rows(ix, &done, &pct);
+        if (following && total > 0) active_row = total - 1;
+
+        if (active_row < start_row) start_row = active_row;
+        else if (active_row >= start_row + max_visible_rows) start_row = active_row - max_visible_rows + 1;
+        if (active_col < start_col) start_col = active_col;
+        else if (active_col >= start_col + max_visible_cols) start_col = active_col - max_visible_cols + 1;
+
+        int n = row_index_read(ix, start_row, max_visible_rows, window);
+
+        clear();
+        mvprintw(0, 0, "%-*s", COL_WIDTH, "");
+        for (int j = start_col; j < window->ncols && j < start_col + max_visible_cols; j++) {
+            char label[10];
+            col_label(j, label);
+            mvprintw(0, COL_WIDTH + (j - start_col) * COL_WIDTH, "%-*s", COL_WIDTH, label);
+        }
+        for (int i = 0; i < n; i++) {
+            mvprintw(i + 1, 0, "%-*lld", COL_WIDTH, start_row + i + 1);
+            for (int j = start_col; j < window->ncols && j < start_col + max_visible_cols; j++) {
+                char buffer[COL_WIDTH+1];
+                strncpy(buffer, window->cells[i][j].data, COL_WIDTH);
+                buffer[COL_WIDTH] = '\0';
+                if (start_row + i == active_row && j == active_col) attron(A_REVERSE);
+                mvprintw(i + 1, COL_WIDTH + (j - start_col) * COL_WIDTH, "%-*s", COL_WIDTH, buffer);
+                if (start_row + i == active_row && j == active_col) attroff(A_REVERSE);
+            }
+        }
+
+        if (done) mvprintw(max_y-1, 0, "%s | %lld filas%s%s | jklh, gg/G, PgUp/PgDn | q: salir",
+                           filename, total, ix->failed ? " (índice incompleto: sin memoria)" : ix->from_cache ? " (índice en caché)" : "",
+                           ix->follow ? (following ? " [siguiendo]" : " [-f pausado, G para seguir]") : "");
+        else mvprintw(max_y-1, 0, "%s | %lld filas (indexando %d%%) | jklh, gg/G, PgUp/PgDn | q: salir", filename, total, pct);
+
+        ColAgg agg;
+        if (ix->aggregate && row_index_agg(ix, active_col, &agg)) {
+            char label[10];
+            col_label(active_col, label);
+            mvprintw(max_y-2, 0, "%s: n=%lld suma=%.2f min=%.2f max=%.2f media=%.2f",
+                     label, agg.count, agg.sum, agg.min, agg.max, agg.sum / agg.count);
+        }
+        refresh();
+
+        // mientras el índice crece, refrescar el contador periódicamente
+        timeout(done && !ix->follow ? -1 : 200);
+        ch = getch();
+        if (ch == ERR) continue;
+
+        long long last_row = total > 0 ? total - 1 : 0;
+        if (ch == 'k' || ch == KEY_PPAGE || ch == 'g') following = 0;
+        if (ch == 'q') break;
+        else if (last_ch == 'g' && ch == 'g') active_row = 0;
+        else if (ch == 'G') { active_row = last_row; following = ix->follow; }
+        else if (ch == 'j' && active_row < last_row) active_row++;
+        else if (ch == 'k' && active_row > 0) active_row--;
+        else if (ch == 'l' && active_col < window->ncols - 1) active_col++;
+        else if (ch == 'h' && active_col > 0) active_col--;
+        else if (ch == KEY_NPAGE) active_row = active_row + max_visible_rows < last_row ? active_row + max_visible_rows : last_row;
+        else if (ch == KEY_PPAGE) active_row = active_row > max_visible_rows ? active_row - max_visible_rows : 0;
+        last_ch = (ch == 'g' && last_ch != 'g') ? 'g' : 0;
+    }
+
     endwin();
+    free(window);
 }
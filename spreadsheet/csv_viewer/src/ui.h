@@ -2,7 +2,9 @@
 #define UI_H
 
 #include "csv_reader.h"
+#include "row_index.h"
 
 void display_sheet(Sheet *sheet, const char *filename);
+void display_indexed(RowIndex *ix, const char *filename);
 
 #endif
@@ -52,3 +52,8 @@ int perform_redo(Sheet *sheet) {
     sheet->cells[act.row][act.col].data[CELL_LEN-1] = '\0';
     return 1;
 }
+
+size_t undo_memory(int *actions) {
+    *actions = (undo_top + 1) + (redo_top + 1);
+    return sizeof(undo_stack) + sizeof(redo_stack);
+}
@@ -2,6 +2,7 @@
 #define UNDO_H
 
 #include "csv_reader.h"
+#include <stddef.h>
 
 #define STACK_SIZE 1000
 
@@ -15,5 +16,7 @@ typedef struct {
 void push_undo(int row, int col, const char *old_val, const char *new_val);
 int perform_undo(Sheet *sheet);
 int perform_redo(Sheet *sheet);
+// Bytes reservados por las pilas y acciones guardadas en ellas
+size_t undo_memory(int *actions);
 
 #endif
@@ -2,6 +2,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <math.h>
+#include <stdarg.h>
+#include <time.h>
+#include <malloc.h>
 
 #define MAX_ROWS 1000
 #define MAX_COLS 1000
@@ -12,10 +22,235 @@ typedef struct {
     char data[CELL_LEN];
 } Cell;
 
-Cell sheet[MAX_ROWS][MAX_COLS];
+// --- TRAZAS ---
+// TRACE_SCOPE("nombre") mide el bloque en el que aparece (cleanup de gcc).
+// Con las trazas apagadas cuesta una rama muy predecible al entrar y otra
+// al salir. Cada hilo escribe en su propio anillo, sin bloqueos; :trace
+// start / :trace stop [archivo] los vuelcan en formato Chrome trace-event
+// (se abre en Perfetto o chrome://tracing).
+
+#define TRACE_RING 16384          // eventos por hilo (potencia de 2)
+#define TRACE_MAX_THREADS 64
+
+typedef struct {
+    const char *name;
+    uint64_t t0, dur;             // ns
+} TraceEvent;
+
+typedef struct {
+    TraceEvent ev[TRACE_RING];
+    uint64_t head;                // solo la escribe el hilo dueño
+    int tid;
+    int in_use;                   // 0: su hilo terminó, se puede reutilizar
+} TraceRing;
+
+typedef struct {
+    const char *name;
+    uint64_t t0;                  // 0 si las trazas estaban apagadas
+} TraceSpan;
+
+int trace_on = 0;
+static TraceRing *trace_rings[TRACE_MAX_THREADS];
+static int trace_nrings = 0;
+static __thread TraceRing *trace_ring;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void trace_release(void *ring) {
+    __atomic_store_n(&((TraceRing *)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_key_init() { pthread_key_create(&trace_key, trace_release); }
+
+static TraceRing *trace_ring_get() {
+    if (trace_ring) return trace_ring;
+    pthread_once(&trace_once, trace_key_init);
+    int n = __atomic_load_n(&trace_nrings, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n && i < TRACE_MAX_THREADS && !trace_ring; i++) {
+        int free_ring = 0;
+        TraceRing *r = __atomic_load_n(&trace_rings[i], __ATOMIC_ACQUIRE);
+        if (r && __atomic_compare_exchange_n(&r->in_use, &free_ring, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            trace_ring = r;
+    }
+    if (!trace_ring) {
+        int idx = __atomic_fetch_add(&trace_nrings, 1, __ATOMIC_ACQ_REL);
+        if (idx >= TRACE_MAX_THREADS) return NULL;
+        TraceRing *r = calloc(1, sizeof(TraceRing));
+        if (!r) return NULL;
+        r->tid = idx + 1;
+        r->in_use = 1;
+        __atomic_store_n(&trace_rings[idx], r, __ATOMIC_RELEASE);
+        trace_ring = r;
+    }
+    pthread_setspecific(trace_key, trace_ring);
+    return trace_ring;
+}
+
+void trace_end(TraceSpan *s) {
+    if (__builtin_expect(!s->t0, 1)) return;
+    TraceRing *r = trace_ring_get();
+    if (!r) return;
+    TraceEvent *e = &r->ev[r->head & (TRACE_RING - 1)];
+    e->name = s->name;
+    e->t0 = s->t0;
+    e->dur = trace_now() - s->t0;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACE_SCOPE(label) \
+    TraceSpan trace_span_ __attribute__((cleanup(trace_end))) = \
+        { label, __builtin_expect(trace_on, 0) ? trace_now() : 0 }
+
+void trace_start() {
+    int n = __atomic_load_n(&trace_nrings, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n && i < TRACE_MAX_THREADS; i++)
+        if (trace_rings[i]) __atomic_store_n(&trace_rings[i]->head, 0, __ATOMIC_RELEASE);
+    trace_on = 1;
+}
+
+// Apaga las trazas y las escribe; devuelve el número de eventos o -1
+long trace_stop(const char *filename) {
+    trace_on = 0;
+    FILE *f = fopen(filename, "w");
+    if (!f) return -1;
+    long count = 0;
+    int n = __atomic_load_n(&trace_nrings, __ATOMIC_ACQUIRE);
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (int i = 0; i < n && i < TRACE_MAX_THREADS; i++) {
+        TraceRing *r = __atomic_load_n(&trace_rings[i], __ATOMIC_ACQUIRE);
+        if (!r) continue;
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > TRACE_RING ? head - TRACE_RING : 0;
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"hilo %d\"}}",
+                count || i ? ",\n" : "", r->tid, r->tid);
+        for (uint64_t k = first; k < head; k++, count++) {
+            const TraceEvent *e = &r->ev[k & (TRACE_RING - 1)];
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    e->name, r->tid, e->t0 / 1e3, e->dur / 1e3);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    return count;
+}
+
+// --- CONTADORES ---
+// Contadores del motor que muestra :stats. Se incrementan con operaciones
+// atómicas relajadas porque también cuentan los hilos de trabajo.
+
+typedef struct {
+    unsigned long long evals;         // llamadas a eval_formula
+    unsigned long long evals_nested;  // de ellas, hechas desde otra fórmula
+    unsigned long long cache_hits, cache_misses;
+    unsigned long long templates;     // fórmulas compiladas a plantilla R[]C[]
+    unsigned long long term_bytes;    // escritos a la terminal
+    unsigned long long filter_rows;   // filas recorridas por filtros
+    unsigned long long eval_ns;       // tiempo en fórmulas de primer nivel
+    unsigned long long frames;
+    unsigned long long frame_evals, frame_nested;   // en el último cuadro
+    unsigned long long max_frame_evals;
+} Counters;
+
+Counters counters;
+
+#define COUNT(field, n) __atomic_fetch_add(&counters.field, (n), __ATOMIC_RELAXED)
+
+// Bytes escritos por el proceso hasta ahora (wchar de /proc/self/io); ncurses
+// escribe directamente en el descriptor, así que se mide alrededor de refresh
+unsigned long long io_written(void) {
+    char buf[256];
+    int fd = open("/proc/self/io", O_RDONLY);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+    char *p = strstr(buf, "wchar:");
+    return p ? strtoull(p + 6, NULL, 10) : 0;
+}
+
+// Hoja activa (ver sección HOJAS): sheet[r][c]
+Cell (*sheet)[MAX_COLS];
 int cur_row = 0, cur_col = 0;
 int nrows = 10, ncols = 5;
 
+// Resultados cacheados de fórmulas: válidos mientras cached_epoch == sheet_epoch.
+// Cualquier cambio en la hoja incrementa sheet_epoch y los invalida.
+double cached_val[MAX_ROWS][MAX_COLS];
+unsigned cached_epoch[MAX_ROWS][MAX_COLS];
+unsigned sheet_epoch = 1;
+// Los valores viejos con época >= cache_floor siguen en su celda y se
+// muestran como desactualizados (~) mientras se recalculan; caches_reset
+// (cambio de hoja, inserciones, cargas) los descarta.
+unsigned cache_floor = 1;
+
+// Metadatos por columna, calculados al cargar (ver sección METADATOS)
+enum { COL_EMPTY = 0, COL_INT, COL_FLOAT, COL_DATE, COL_TEXT };
+
+typedef struct {
+    int valid;        // 0 si la columna cambió desde el último cálculo
+    int type;         // COL_*
+    int header;       // la fila 1 es un encabezado de texto
+    int count;        // celdas no vacías (sin encabezado)
+    int nulls;        // celdas vacías
+    int formulas;
+    int numeric;      // celdas que aportan a min/max/suma
+    double min, max, sum;   // sobre valores numéricos (fechas como AAAAMMDD)
+} ColMeta;
+
+ColMeta col_meta[MAX_COLS];
+
+// Versión de cada columna: cambia con cualquier edición que la afecte
+unsigned col_version[MAX_COLS];
+
+void lookup_index_drop_sheet();
+void lookup_index_cell_changed(int row, int col);
+void lookup_index_row_inserted(int pos);
+void lookup_index_row_removed(int pos);
+void lookup_index_col_shifted(int pos, int delta);
+void search_index_reset();
+void search_index_cell_changed(int row, int col);
+
+// Invalida todo lo calculado sobre la hoja activa
+void caches_reset() {
+    sheet_epoch++;
+    cache_floor = sheet_epoch;
+    for (int j = 0; j < MAX_COLS; j++) {
+        col_meta[j].valid = 0;
+        col_version[j]++;
+    }
+    search_index_reset();
+}
+
+// Cambio estructural o de muchas celdas
+void sheet_touch() {
+    caches_reset();
+    lookup_index_drop_sheet();
+}
+
+// Cambio de una sola celda
+void cell_touch(int row, int col) {
+    sheet_epoch++;
+    if (col >= 0 && col < MAX_COLS) {
+        col_meta[col].valid = 0;
+        col_version[col]++;
+    }
+    lookup_index_cell_changed(row, col);
+    search_index_cell_changed(row, col);
+}
+
+// Columnas de un .msheet aún sin decodificar (ver sección MSHEET)
+void ensure_col(int col);
+int col_decoded(int col);
+void msheet_materialize();
+void search_index_col_decoded(int col);
+
 int formula_mode = 0;
 char formula_buffer[FORMULA_MAX];
 int formula_row = -1, formula_col = -1;
@@ -30,23 +265,119 @@ int row_offset = 0, col_offset = 0;
 // Para navegación tipo Vim
 int last_ch = 0;
 
+// Mensaje para la línea de estado (ver COMANDOS)
+char status_msg[256];
+
+// --- HOJAS ---
+// Un libro con varias hojas. Los globales sheet/nrows/ncols/cursor son los de
+// la hoja activa; al cambiar de hoja se guardan en su entrada de sheets[].
+#define MAX_SHEETS 16
+
+typedef struct {
+    char name[32];
+    Cell (*cells)[MAX_COLS];
+    int nrows, ncols;
+    int cur_row, cur_col;
+    int row_offset, col_offset;
+} Sheet;
+
+Sheet sheets[MAX_SHEETS];
+int nsheets = 0, cur_sheet = 0;
+
+void caches_reset();
+void deactivate_filter();
+
+// Crea una hoja vacía; devuelve su índice o -1
+int sheet_new(const char *name) {
+    if (nsheets >= MAX_SHEETS) return -1;
+    Cell (*cells)[MAX_COLS] = calloc(MAX_ROWS, sizeof(*cells));
+    if (!cells) return -1;
+    Sheet *sh = &sheets[nsheets];
+    memset(sh, 0, sizeof(Sheet));
+    snprintf(sh->name, sizeof(sh->name), "%s", name);
+    sh->cells = cells;
+    return nsheets++;
+}
+
+// Vuelca el estado de la hoja activa en su entrada
+void sheet_store() {
+    Sheet *sh = &sheets[cur_sheet];
+    sh->nrows = nrows; sh->ncols = ncols;
+    sh->cur_row = cur_row; sh->cur_col = cur_col;
+    sh->row_offset = row_offset; sh->col_offset = col_offset;
+}
+
+void sheet_switch(int idx) {
+    if (idx < 0 || idx >= nsheets || idx == cur_sheet) return;
+    msheet_materialize();
+    sheet_store();
+    deactivate_filter();
+    cur_sheet = idx;
+    Sheet *sh = &sheets[idx];
+    sheet = sh->cells;
+    nrows = sh->nrows; ncols = sh->ncols;
+    cur_row = sh->cur_row; cur_col = sh->cur_col;
+    row_offset = sh->row_offset; col_offset = sh->col_offset;
+    // los cachés son de la hoja activa
+    caches_reset();
+}
+
 // --- FILTROS ---
+// El valor admite un operador: =x (igual), >n, >=n, <n, <=n; sin operador
+// filtra por subcadena. Las filas que pasan se calculan una vez por cambio
+// de la hoja (filter_rows); si la columna tiene un índice declarado se usa.
+enum { FILTER_SUBSTR = 0, FILTER_EQ, FILTER_LT, FILTER_LE, FILTER_GT, FILTER_GE };
+
 int filter_active = 0;
 int filter_col = -1;
 char filter_value[CELL_LEN];
+int filter_op = FILTER_SUBSTR;
+const char *filter_operand = filter_value;
+unsigned char filter_rows[MAX_ROWS];
+unsigned filter_epoch = 0;
+int filter_indexed = 0;
+
+// Ver sección BÚSQUEDAS ENTRE HOJAS; devuelve 1 si usó un índice
+int filter_eval(int col, int op, const char *operand, unsigned char *rows);
+int eval_interrupted();
+
+static void filter_parse() {
+    const char *v = filter_value;
+    filter_op = FILTER_SUBSTR;
+    if (v[0] == '=') filter_op = FILTER_EQ, v++;
+    else if (v[0] == '<' && v[1] == '=') filter_op = FILTER_LE, v += 2;
+    else if (v[0] == '>' && v[1] == '=') filter_op = FILTER_GE, v += 2;
+    else if (v[0] == '<') filter_op = FILTER_LT, v++;
+    else if (v[0] == '>') filter_op = FILTER_GT, v++;
+    while (filter_op != FILTER_SUBSTR && *v == ' ') v++;
+    filter_operand = v;
+}
 
 int filter_matches(int row) {
     if (!filter_active || filter_col < 0 || filter_col >= ncols) return 1;
-    return strstr(sheet[row][filter_col].data, filter_value) != NULL;
+    // con el plazo del cuadro agotado las fórmulas valen NAN: el filtro queda
+    // pendiente (el cuadro lo marca con ~) y se rehace en el siguiente tramo
+    if (filter_epoch != sheet_epoch && !eval_interrupted()) {
+        ensure_col(filter_col);
+        filter_indexed = filter_eval(filter_col, filter_op, filter_operand, filter_rows);
+        if (!eval_interrupted()) filter_epoch = sheet_epoch;
+    }
+    return filter_rows[row];
+}
+
+int filter_pending() {
+    return filter_active && filter_col >= 0 && filter_col < ncols && filter_epoch != sheet_epoch;
 }
 
 void activate_filter() {
     echo();
     mvprintw(nrows + 5, 0, "Filtrar columna (A=0, B=1,...): ");
     scanw("%d", &filter_col);
-    mvprintw(nrows + 6, 0, "Valor a filtrar: ");
+    mvprintw(nrows + 6, 0, "Valor a filtrar (texto, =x, >n, <=n...): ");
     getnstr(filter_value, CELL_LEN-1);
     noecho();
+    filter_parse();
+    filter_epoch = 0;
     filter_active = 1;
     cur_row = 0; row_offset = 0;
 }
@@ -66,40 +397,261 @@ void sanitize(char *s) {
     }
 }
 
+// --- METADATOS DE COLUMNA ---
+// Tipo inferido (int < float; fecha; si se mezclan, texto), nulos y
+// min/max/suma. load_csv los va acumulando mientras separa los campos;
+// tras una edición se recalculan al pedirlos con col_meta_get().
+
+static int is_date(const char *s, double *v) {
+    int a, b, c, n = 0;
+    if (sscanf(s, "%4d-%2d-%2d%n", &a, &b, &c, &n) == 3 && s[n] == '\0' && n == 10) {
+        // AAAA-MM-DD
+    } else if (sscanf(s, "%2d/%2d/%4d%n", &c, &b, &a, &n) == 3 && s[n] == '\0' && n == 10) {
+        // DD/MM/AAAA
+    } else return 0;
+    if (b < 1 || b > 12 || c < 1 || c > 31) return 0;
+    *v = a * 10000.0 + b * 100 + c;
+    return 1;
+}
+
+// Decimal plano: signo opcional, dígitos, '.' opcional y exponente
+// opcional. Deja fuera lo demás que acepta strtod (nan, inf, 0x1p3)
+static int is_decimal(const char *p) {
+    int digits = 0;
+    if (*p == '-' || *p == '+') p++;
+    while (isdigit((unsigned char)*p)) { p++; digits++; }
+    if (*p == '.') {
+        p++;
+        while (isdigit((unsigned char)*p)) { p++; digits++; }
+    }
+    if (!digits) return 0;
+    if (*p == 'e' || *p == 'E') {
+        p++;
+        if (*p == '-' || *p == '+') p++;
+        if (!isdigit((unsigned char)*p)) return 0;
+        while (isdigit((unsigned char)*p)) p++;
+    }
+    return *p == '\0';
+}
+
+// Clasifica el texto de una celda; en *v deja su valor si es numérico/fecha
+int classify_cell(const char *s, double *v) {
+    if (!s[0]) return COL_EMPTY;
+    const char *p = s;
+    if (*p == '-' || *p == '+') p++;
+    if (isdigit((unsigned char)*p)) {
+        while (isdigit((unsigned char)*p)) p++;
+        if (*p == '\0') { *v = atof(s); return COL_INT; }
+    }
+    if (is_decimal(s)) {
+        *v = strtod(s, NULL);
+        return COL_FLOAT;
+    }
+    if (is_date(s, v)) return COL_DATE;
+    return COL_TEXT;
+}
+
+// Combina el tipo acumulado de una columna con el de una celda nueva
+static int merge_type(int acc, int t) {
+    if (t == COL_EMPTY || acc == t) return acc == COL_EMPTY ? t : acc;
+    if (acc == COL_EMPTY) return t;
+    if ((acc == COL_INT && t == COL_FLOAT) || (acc == COL_FLOAT && t == COL_INT)) return COL_FLOAT;
+    return COL_TEXT;
+}
+
+// Estado de la primera fila, que puede resultar ser encabezado
+typedef struct {
+    int type;
+    double v;
+} FirstCell;
+
+static FirstCell first_cell[MAX_COLS];
+
+static void col_meta_reset(int col) {
+    memset(&col_meta[col], 0, sizeof(ColMeta));
+    first_cell[col].type = COL_EMPTY;
+}
+
+static void col_meta_accum(ColMeta *m, int t, double v) {
+    if (t == COL_EMPTY) { m->nulls++; return; }
+    m->count++;
+    if (t < 0) { m->formulas++; m->type = merge_type(m->type, COL_FLOAT); return; }
+    m->type = merge_type(m->type, t);
+    if (t == COL_TEXT) return;
+    if (m->numeric == 0 || v < m->min) m->min = v;
+    if (m->numeric == 0 || v > m->max) m->max = v;
+    m->sum += v;
+    m->numeric++;
+}
+
+// t < 0 marca una fórmula (su valor no se conoce sin evaluarla)
+static void col_meta_add(int col, int row, const char *s) {
+    double v = 0;
+    int t = s[0] == '=' ? -1 : classify_cell(s, &v);
+    if (row == 0) {
+        // se decide al final si cuenta como dato o como encabezado
+        first_cell[col].type = t;
+        first_cell[col].v = v;
+        return;
+    }
+    col_meta_accum(&col_meta[col], t, v);
+}
+
+static void col_meta_finish(int col, int rows) {
+    ColMeta *m = &col_meta[col];
+    FirstCell *f = &first_cell[col];
+    m->valid = 1;
+    if (rows == 0) return;
+    m->header = f->type == COL_TEXT && m->type != COL_TEXT && m->type != COL_EMPTY;
+    if (!m->header) col_meta_accum(m, f->type, f->v);
+}
+
+// Metadatos de una columna, recalculándolos si la columna cambió
+const ColMeta *col_meta_get(int col) {
+    if (col < 0 || col >= MAX_COLS) return NULL;
+    if (!col_meta[col].valid) {
+        ensure_col(col);
+        col_meta_reset(col);
+        for (int i = 0; i < nrows; i++) col_meta_add(col, i, sheet[i][col].data);
+        col_meta_finish(col, nrows);
+    }
+    return &col_meta[col];
+}
+
+const char *col_type_name(int type) {
+    switch (type) {
+        case COL_INT: return "entero";
+        case COL_FLOAT: return "decimal";
+        case COL_DATE: return "fecha";
+        case COL_TEXT: return "texto";
+        default: return "vacía";
+    }
+}
+
 // Excel-style nombre de celda
-void cell_name(int row, int col, char *buf) {
-    char colname[10];
-    int c = col;
-    int len = 0;
+// Letras de las columnas de 1 a 3 letras (A..ZZZ), calculadas una vez
+#define COL_LABELS 18278
+
+static char col_labels[COL_LABELS][4];
+static unsigned char col_label_len[COL_LABELS];
+
+static void col_labels_init() {
+    for (int col = 0; col < COL_LABELS; col++) {
+        char tmp[4];
+        int c = col, len = 0;
+        do {
+            tmp[len++] = 'A' + (c % 26);
+            c = c / 26 - 1;
+        } while (c >= 0);
+        for (int i = 0; i < len; i++) col_labels[col][i] = tmp[len - 1 - i];
+        col_label_len[col] = len;
+    }
+}
+
+// Letras de la columna en buf (sin terminar); devuelve cuántas
+int col_label(int col, char *buf) {
+    if (!col_label_len[0]) col_labels_init();
+    if (col >= 0 && col < COL_LABELS) {
+        memcpy(buf, col_labels[col], 4);
+        return col_label_len[col];
+    }
+    char tmp[10];
+    int c = col, len = 0;
     do {
-        colname[len++] = 'A' + (c % 26);
+        tmp[len++] = 'A' + (c % 26);
         c = c / 26 - 1;
     } while (c >= 0);
-    for (int i = 0; i < len; i++)
-        buf[i] = colname[len - 1 - i];
-    sprintf(buf + len, "%d", row + 1);
+    for (int i = 0; i < len; i++) buf[i] = tmp[len - 1 - i];
+    return len;
+}
+
+// Entero sin signo en decimal, terminado en '\0'; devuelve la longitud
+int fmt_uint(unsigned v, char *buf) {
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char tmp[12];
+    int n = 12;
+    while (v >= 100) {
+        unsigned q = v / 100, r = v - q * 100;
+        tmp[--n] = pairs[2 * r + 1];
+        tmp[--n] = pairs[2 * r];
+        v = q;
+    }
+    if (v >= 10) {
+        tmp[--n] = pairs[2 * v + 1];
+        tmp[--n] = pairs[2 * v];
+    } else {
+        tmp[--n] = '0' + v;
+    }
+    memcpy(buf, tmp + n, 12 - n);
+    buf[12 - n] = '\0';
+    return 12 - n;
+}
+
+void cell_name(int row, int col, char *buf) {
+    int len = col_label(col, buf);
+    if (row >= 0) fmt_uint(row + 1, buf + len);
+    else sprintf(buf + len, "%d", row + 1);
+}
+
+// Letras de la columna como texto ("B")
+void col_name(int col, char *buf) {
+    buf[col_label(col, buf)] = '\0';
 }
 
 // Parsear referencia
 int parse_cell(const char *ref, int *row, int *col) {
     int c = 0, r = 0, i = 0;
-    while (isalpha(ref[i])) {
-        c = c * 26 + (toupper(ref[i]) - 'A' + 1);
-        i++;
+    for (;; i++) {
+        unsigned u = (unsigned char)ref[i] - 'A', l = (unsigned char)ref[i] - 'a';
+        if (u < 26) c = c * 26 + u + 1;
+        else if (l < 26) c = c * 26 + l + 1;
+        else break;
+        if (c > MAX_COLS) c = MAX_COLS + 1;    // fuera de rango, sin desbordar
     }
-    c--; 
-    while (isdigit(ref[i])) {
-        r = r * 10 + (ref[i] - '0');
-        i++;
+    c--;
+    for (unsigned d; (d = (unsigned char)ref[i] - '0') < 10; i++) {
+        r = r * 10 + d;
+        if (r > MAX_ROWS) r = MAX_ROWS + 1;
     }
-    r--; 
+    r--;
     if (r < 0 || r >= MAX_ROWS || c < 0 || c >= MAX_COLS) return 0;
     *row = r; *col = c;
     return 1;
 }
 
+// "B" -> 1; -1 si no es una columna válida
+int col_from_name(const char *s) {
+    int c = 0, i = 0;
+    while (isalpha((unsigned char)s[i])) {
+        c = c * 26 + (toupper((unsigned char)s[i]) - 'A' + 1);
+        if (c > MAX_COLS) c = MAX_COLS + 1;
+        i++;
+    }
+    if (i == 0 || s[i] != '\0' || c > MAX_COLS) return -1;
+    return c - 1;
+}
+
 // Evaluar fórmula simple
 double eval_formula(const char *formula);
+double eval_function(const char *name, const char **s);
+double sheet_value(int sh, int row, int col);
+int sheet_find(const char *name);
+
+// Lee un identificador (letras, dígitos, '_') en buf
+int read_ident(const char **s, char *buf, int size) {
+    int j = 0;
+    while (isalnum((unsigned char)**s) || **s == '_') {
+        if (j < size - 1) buf[j++] = **s;
+        (*s)++;
+    }
+    buf[j] = '\0';
+    return j;
+}
+
+// Se detiene en ')' o ',' sin consumirlos (argumentos de funciones)
 double eval_expr(const char **s) {
     double res = 0;
     double num = 0;
@@ -111,19 +663,28 @@ double eval_expr(const char **s) {
         if (**s == '(') {
             (*s)++;
             num = eval_expr(s);
+            if (**s == ')') (*s)++;
         } else if (isalpha(**s)) {
-            char ref[16]; int j = 0;
-            while (isalpha(**s) || isdigit(**s)) ref[j++] = *(*s)++;
-            ref[j] = '\0';
-            int r, c;
-            if (parse_cell(ref, &r, &c)) {
-                if (sheet[r][c].data[0] == '=') num = eval_formula(sheet[r][c].data);
-                else num = atof(sheet[r][c].data);
-            } else num = 0;
+            char ref[32];
+            read_ident(s, ref, sizeof(ref));
+            int r, c, sh = -1;
+            if (**s == '(') {
+                (*s)++;
+                num = eval_function(ref, s);
+                goto apply;
+            }
+            if (**s == '!') {
+                // referencia a otra hoja: hoja!A1
+                (*s)++;
+                sh = sheet_find(ref);
+                read_ident(s, ref, sizeof(ref));
+                if (sh < 0) { num = NAN; goto apply; }
+            }
+            if (parse_cell(ref, &r, &c)) num = sheet_value(sh, r, c);
+            else num = 0;
         } else if (isdigit(**s) || **s == '.') {
             num = strtod(*s, (char **)s);
-        } else if (**s == ')') {
-            (*s)++;
+        } else if (**s == ')' || **s == ',') {
             break;
         } else {
             op = **s;
@@ -131,6 +692,7 @@ double eval_expr(const char **s) {
             continue;
         }
 
+    apply:
         switch (op) {
             case '+': res += num; break;
             case '-': res -= num; break;
@@ -142,10 +704,46 @@ double eval_expr(const char **s) {
     return res;
 }
 
+// Profundidad de fórmulas en evaluación en este hilo (referencias a fórmulas)
+static __thread int eval_depth;
+static __thread int eval_running;       // dentro de eval_cell (la cronometra ella)
+
+// Resultado de una fórmula que depende de sí misma: un NAN con una carga
+// propia, que se muestra como #CYCLE. En la hoja activa los ciclos se
+// detectan en eval_cell. Las fórmulas de las demás hojas se evalúan
+// anidando llamadas: sheet_value lleva la lista de celdas en curso (un
+// ciclo entre ellas también es #CYCLE) y una cadena de más de
+// EVAL_MAX_DEPTH fórmulas anidadas se corta con #DEPTH, que no es un ciclo
+// sino el límite de la pila de C.
+#define EVAL_MAX_DEPTH 2048
+static const union { uint64_t bits; double v; } cycle_nan = { 0x7ff800000000c1c1ull };
+static const union { uint64_t bits; double v; } depth_nan = { 0x7ff800000000dedeull };
+#define CYCLE_VALUE (cycle_nan.v)
+#define DEPTH_VALUE (depth_nan.v)
+
+int is_cycle(double v) {
+    union { double v; uint64_t bits; } u = { v };
+    return u.bits == cycle_nan.bits;
+}
+
+int is_depth(double v) {
+    union { double v; uint64_t bits; } u = { v };
+    return u.bits == depth_nan.bits;
+}
+
 double eval_formula(const char *formula) {
+    TRACE_SCOPE("eval");
     if (!formula || formula[0] != '=') return 0;
+    if (eval_depth >= EVAL_MAX_DEPTH) return DEPTH_VALUE;
+    COUNT(evals, 1);
+    if (eval_depth) COUNT(evals_nested, 1);
+    uint64_t t0 = eval_depth || eval_running ? 0 : trace_now();
+    eval_depth++;
     const char *s = formula + 1;
-    return eval_expr(&s);
+    double v = eval_expr(&s);
+    eval_depth--;
+    if (t0) COUNT(eval_ns, trace_now() - t0);
+    return v;
 }
 
 // Actualiza referencia dinámica
@@ -161,10 +759,219 @@ void update_dynamic_ref() {
     formula_buffer[FORMULA_MAX - 1] = '\0';
     strncpy(sheet[formula_row][formula_col].data, formula_buffer, CELL_LEN - 1);
     sheet[formula_row][formula_col].data[CELL_LEN - 1] = '\0';
+    cell_touch(formula_row, formula_col);
+}
+
+// Plazo de la evaluación en curso en este hilo (0: sin plazo). Pasado el
+// plazo, formula_value devuelve NAN sin memorizar y eval_aborted queda a 1;
+// lo ya calculado se conserva, así que el tramo siguiente continúa desde
+// ahí (ver RECÁLCULO)
+static __thread uint64_t eval_deadline;
+static __thread int eval_aborted;
+static __thread unsigned eval_ticks;   // el reloj se consulta cada 64 pasos
+
+void eval_budget(unsigned ms) {
+    eval_deadline = ms ? trace_now() + ms * 1000000ull : 0;
+    eval_aborted = 0;
+}
+
+int eval_interrupted() { return eval_aborted; }
+
+// Evaluación de la hoja activa con una pila explícita en vez de recursión.
+// Se evalúa la fórmula de la cima; las referencias a fórmulas aún sin
+// calcular valen 0 y se anotan (eval_missing). Si hubo alguna, se apilan
+// encima y la fórmula se vuelve a evaluar cuando estén calculadas; si no,
+// su valor queda en el caché y se desapila. La pila de C no crece con la
+// longitud de las cadenas de referencias. Un mutex deja a los hilos de
+// :groupby usar la misma pila; los aciertos del caché no lo toman.
+//
+// Con un 0 provisional la fórmula puede seguir caminos que la evaluación
+// real no toma (una búsqueda que encuentra otra fila), así que solo la
+// primera referencia pendiente de una pasada es segura: hasta ella no se
+// usó ningún valor provisional. Las demás se apilan como especulativas.
+// Una celda ya expandida es un antecesor de la cima: pedirla como primera
+// referencia cierra un ciclo si todas las celdas expandidas desde ella
+// hasta la cima se apilaron como seguras, y entonces valen #CYCLE. Si en
+// el camino hay una especulativa, esa no hacía falta todavía: se desapila
+// con lo de encima y queda aplazada (eval_nospec), y solo vuelve a la pila
+// cuando una pasada la pida como referencia segura.
+#define EVAL_MISSING_MAX 32
+enum { EV_NONE = 0, EV_PENDING, EV_EXPANDED };
+
+typedef struct {
+    int row, col;
+    unsigned char spec;    // apilada por una referencia especulativa
+    unsigned char open;    // esta entrada la expandió (es antecesor de la cima)
+} EvalFrame;
+
+static EvalFrame *eval_stack = NULL;
+static int eval_cap = 0;
+static unsigned char eval_state[MAX_ROWS][MAX_COLS];   // EV_*
+static unsigned char eval_nospec[MAX_ROWS][MAX_COLS];  // aplazadas en este eval_cell
+static EvalFrame *eval_deferred = NULL;                // las celdas con eval_nospec
+static int eval_ndeferred = 0, eval_deferred_cap = 0;
+static pthread_mutex_t eval_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread EvalFrame eval_missing[EVAL_MISSING_MAX];
+static __thread int eval_nmissing;
+static __thread unsigned eval_placeholders;   // 0 provisionales devueltos
+
+static void eval_store(int row, int col, double v, unsigned epoch) {
+    cached_val[row][col] = v;
+    __atomic_store_n(&cached_epoch[row][col], epoch, __ATOMIC_RELEASE);
+}
+
+static int eval_push(int sp, int row, int col, int spec) {
+    if (sp == eval_cap) {
+        int cap = eval_cap ? eval_cap * 2 : 1024;
+        EvalFrame *st = realloc(eval_stack, cap * sizeof(EvalFrame));
+        if (!st) return -1;
+        eval_stack = st;
+        eval_cap = cap;
+    }
+    eval_stack[sp].row = row;
+    eval_stack[sp].col = col;
+    eval_stack[sp].spec = spec;
+    eval_stack[sp].open = 0;
+    eval_state[row][col] = EV_PENDING;
+    return sp + 1;
+}
+
+// Desapila desde la entrada k (especulativa) y aplaza su celda; -1 sin memoria
+static int eval_defer(int sp, int k) {
+    if (eval_ndeferred == eval_deferred_cap) {
+        int cap = eval_deferred_cap ? eval_deferred_cap * 2 : 64;
+        EvalFrame *d = realloc(eval_deferred, cap * sizeof(EvalFrame));
+        if (!d) return -1;
+        eval_deferred = d;
+        eval_deferred_cap = cap;
+    }
+    eval_deferred[eval_ndeferred++] = eval_stack[k];
+    eval_nospec[eval_stack[k].row][eval_stack[k].col] = 1;
+    for (; sp > k; sp--) eval_state[eval_stack[sp - 1].row][eval_stack[sp - 1].col] = EV_NONE;
+    return sp;
+}
+
+// Marca #CYCLE las celdas expandidas desde (row, col) hasta la cima y
+// desapila todo lo que hay por encima de (row, col) incluida; devuelve sp
+static int eval_cycle(int sp, int row, int col, unsigned epoch) {
+    int k = sp - 1;
+    while (k > 0 && (eval_stack[k].row != row || eval_stack[k].col != col || !eval_stack[k].open)) k--;
+    for (; sp > k; sp--) {
+        EvalFrame *e = &eval_stack[sp - 1];
+        if (eval_state[e->row][e->col] == EV_EXPANDED) eval_store(e->row, e->col, CYCLE_VALUE, epoch);
+        eval_state[e->row][e->col] = EV_NONE;
+    }
+    return sp;
+}
+
+static double eval_cell(int row, int col) {
+    TRACE_SCOPE("eval_cell");
+    unsigned epoch = sheet_epoch;
+    uint64_t t0 = trace_now();
+    pthread_mutex_lock(&eval_lock);
+    eval_running = 1;
+    int sp = eval_push(0, row, col, 0);
+    while (sp > 0) {
+        if (eval_deadline && (++eval_ticks & 63) == 0 && trace_now() > eval_deadline) {
+            eval_aborted = 1;
+            break;
+        }
+        EvalFrame *f = &eval_stack[sp - 1];
+        int r = f->row, c = f->col;
+        if (cached_epoch[r][c] == epoch) {      // repetida: ya se calculó
+            sp--;
+            continue;
+        }
+        eval_state[r][c] = EV_EXPANDED;
+        f->open = 1;
+        eval_nmissing = 0;
+        eval_depth += sp > 1;                   // precedente: cuenta como anidada
+        double v = eval_formula(sheet[r][c].data);
+        eval_depth -= sp > 1;
+        if (eval_nmissing == 0) {
+            eval_store(r, c, v, epoch);
+            eval_state[r][c] = EV_NONE;
+            sp--;
+            continue;
+        }
+        int mr = eval_missing[0].row, mc = eval_missing[0].col;
+        if (eval_state[mr][mc] == EV_EXPANDED) {
+            // ¿ciclo seguro, o pasa por una celda especulativa?
+            int k = sp - 1, spec = -1;
+            while (k > 0 && (eval_stack[k].row != mr || eval_stack[k].col != mc || !eval_stack[k].open)) {
+                if (eval_stack[k].open && eval_stack[k].spec) spec = k;
+                k--;
+            }
+            sp = spec < 0 ? eval_cycle(sp, mr, mc, epoch) : eval_defer(sp, spec);
+            if (sp < 0) { sp = 0; eval_aborted = 1; break; }
+            continue;
+        }
+        int n = eval_nmissing;
+        sp = eval_push(sp, mr, mc, 0);
+        for (int k = 1; k < n && sp > 0; k++) {
+            mr = eval_missing[k].row, mc = eval_missing[k].col;
+            if (cached_epoch[mr][mc] == epoch || eval_state[mr][mc] == EV_EXPANDED || eval_nospec[mr][mc])
+                continue;
+            sp = eval_push(sp, mr, mc, 1);
+        }
+        if (sp < 0) { sp = 0; eval_aborted = 1; break; }
+    }
+    // cortado por el plazo: lo que quedó en la pila vuelve a estar libre
+    while (sp > 0) {
+        sp--;
+        eval_state[eval_stack[sp].row][eval_stack[sp].col] = EV_NONE;
+    }
+    while (eval_ndeferred > 0) {
+        eval_ndeferred--;
+        eval_nospec[eval_deferred[eval_ndeferred].row][eval_deferred[eval_ndeferred].col] = 0;
+    }
+    eval_running = 0;
+    pthread_mutex_unlock(&eval_lock);
+    COUNT(eval_ns, trace_now() - t0);
+    if (cached_epoch[row][col] != epoch) return NAN;
+    return cached_val[row][col];
+}
+
+// Valor de la fórmula de la hoja activa en (row, col). Se evalúa a demanda
+// (al dibujarla, guardarla o cuando otra fórmula la referencia) y queda
+// memorizado hasta el próximo cambio de la hoja, así que cada cuadro solo
+// calcula las celdas visibles y sus precedentes, y cada una una sola vez.
+double formula_value(int row, int col) {
+    if (__atomic_load_n(&cached_epoch[row][col], __ATOMIC_ACQUIRE) == sheet_epoch) {
+        COUNT(cache_hits, 1);
+        return cached_val[row][col];
+    }
+    COUNT(cache_misses, 1);
+    if (eval_running) {
+        // referencia desde la fórmula que evalúa eval_cell: queda pendiente
+        eval_placeholders++;
+        if (eval_nmissing < EVAL_MISSING_MAX) {
+            eval_missing[eval_nmissing].row = row;
+            eval_missing[eval_nmissing].col = col;
+            eval_nmissing++;
+        }
+        return 0;
+    }
+    if (eval_aborted) return NAN;
+    return eval_cell(row, col);
 }
 
+// Cada cuadro evalúa fórmulas durante a lo sumo RECALC_FRAME_MS; las que
+// quedan se dibujan con su valor anterior marcado con ~ y las termina el
+// recálculo por tramos (ver RECÁLCULO)
+#define RECALC_FRAME_MS 5
+int frame_stale = 0;          // celdas desactualizadas en el último cuadro
+
+// Coincidencias de la búsqueda en curso (ver BÚSQUEDA); :nohl las apaga
+char search_hl[CELL_LEN];
+int cell_highlighted(int row, int col);
+
 // Dibujar hoja con filtro aplicado
 void draw_sheet_filtered() {
+    TRACE_SCOPE("render");
+    unsigned long long evals0 = counters.evals, nested0 = counters.evals_nested;
+    eval_budget(RECALC_FRAME_MS);
+    frame_stale = 0;
     clear();
     int max_y, max_x;
     getmaxyx(stdscr, max_y, max_x);
@@ -191,41 +998,91 @@ void draw_sheet_filtered() {
         mvprintw(line, 0, "%-3d", i+1);
         for (int j = 0; j < visible_cols && j + col_offset < ncols; j++) {
             int c = j + col_offset;
+            ensure_col(c);
+            int hl = cell_highlighted(i, c);
+            if (hl) attron(A_REVERSE);
             if (edit_mode && i == cur_row && c == cur_col)
                 mvprintw(line, (j+1) * 12, "%-11s", edit_buffer);
-            else if (sheet[i][c].data[0] == '=')
-                mvprintw(line, (j+1) * 12, "%-11.2f", eval_formula(sheet[i][c].data));
+            else if (sheet[i][c].data[0] == '=') {
+                double v = formula_value(i, c);
+                if (eval_aborted && cached_epoch[i][c] != sheet_epoch) {
+                    frame_stale++;
+                    if (cached_epoch[i][c] >= cache_floor && !isnan(cached_val[i][c]))
+                        mvprintw(line, (j+1) * 12, "~%-10.2f", cached_val[i][c]);
+                    else
+                        mvprintw(line, (j+1) * 12, "%-11s", "~");
+                }
+                else if (is_cycle(v)) mvprintw(line, (j+1) * 12, "%-11s", "#CYCLE");
+                else if (is_depth(v)) mvprintw(line, (j+1) * 12, "%-11s", "#DEPTH");
+                else if (isnan(v)) mvprintw(line, (j+1) * 12, "%-11s", "#N/A");
+                else mvprintw(line, (j+1) * 12, "%-11.2f", v);
+            }
             else
                 mvprintw(line, (j+1) * 12, "%-11s", sheet[i][c].data[0] ? sheet[i][c].data : ".");
+            if (hl) attroff(A_REVERSE);
         }
         line++;
     }
+    if (filter_pending()) frame_stale++;
 
+    if (status_msg[0]) mvprintw(visible_rows + 1, 0, "%s", status_msg);
     mvprintw(visible_rows + 2, 0, "Modo: %s", formula_mode ? "FORMULA" : edit_mode ? "EDIT" : "NORMAL");
+    const ColMeta *meta = col_meta_get(cur_col);
+    if (meta) printw("   Columna: %s%s", col_type_name(meta->type), meta->header ? " (con encabezado)" : "");
+    eval_budget(0);
+    if (frame_stale) printw("   ~ recalculando");
+    if (nsheets > 1) {
+        printw("   Hojas:");
+        for (int k = 0; k < nsheets; k++)
+            printw(k == cur_sheet ? " [%d:%s]" : " %d:%s", k + 1, sheets[k].name);
+    }
     if (formula_mode) mvprintw(visible_rows + 3, 0, "Formula: %s", formula_buffer);
-    if (filter_active) mvprintw(visible_rows + 4, 0, "Filtro activo: Columna %d contiene '%s'", filter_col+1, filter_value);
+    if (filter_active && filter_op == FILTER_SUBSTR)
+        mvprintw(visible_rows + 4, 0, "Filtro activo: Columna %d contiene '%s'", filter_col+1, filter_value);
+    else if (filter_active)
+        mvprintw(visible_rows + 4, 0, "Filtro activo: Columna %d %s%s", filter_col+1, filter_value,
+                 filter_indexed ? " (índice)" : "");
+
+    counters.frames++;
+    counters.frame_evals = counters.evals - evals0;
+    counters.frame_nested = counters.evals_nested - nested0;
+    if (counters.frame_evals > counters.max_frame_evals) counters.max_frame_evals = counters.frame_evals;
 
     move(cur_row - row_offset + 1, (cur_col - col_offset + 1) * 12);
+    unsigned long long w0 = io_written();
     refresh();
+    counters.term_bytes += io_written() - w0;
 }
 
 // Insertar/eliminar fila/col
 void insert_row(int pos) {
+    TRACE_SCOPE("insert_row");
     if (nrows >= MAX_ROWS) return;
+    msheet_materialize();
+    caches_reset();
     for (int i = nrows; i > pos; i--)
         memcpy(sheet[i], sheet[i-1], sizeof(Cell)*MAX_COLS);
     memset(sheet[pos], 0, sizeof(Cell)*MAX_COLS);
     nrows++;
+    lookup_index_row_inserted(pos);
 }
 void remove_row(int pos) {
+    TRACE_SCOPE("remove_row");
     if (nrows <= 1) return;
+    msheet_materialize();
+    caches_reset();
     for (int i = pos; i < nrows-1; i++)
         memcpy(sheet[i], sheet[i+1], sizeof(Cell)*MAX_COLS);
     memset(sheet[nrows-1], 0, sizeof(Cell)*MAX_COLS);
     nrows--;
+    lookup_index_row_removed(pos);
 }
 void insert_col(int pos) {
+    TRACE_SCOPE("insert_col");
     if (ncols >= MAX_COLS) return;
+    msheet_materialize();
+    caches_reset();
+    lookup_index_col_shifted(pos, 1);
     for (int i = 0; i < nrows; i++)
         for (int j = ncols; j > pos; j--)
             sheet[i][j] = sheet[i][j-1];
@@ -234,7 +1091,11 @@ void insert_col(int pos) {
     ncols++;
 }
 void remove_col(int pos) {
+    TRACE_SCOPE("remove_col");
     if (ncols <= 1) return;
+    msheet_materialize();
+    caches_reset();
+    lookup_index_col_shifted(pos, -1);
     for (int i = 0; i < nrows; i++)
         for (int j = pos; j < ncols-1; j++)
             sheet[i][j] = sheet[i][j+1];
@@ -244,7 +1105,10 @@ void remove_col(int pos) {
 
 // Rellenar columna fórmulas
 void fill_formula_column(int col) {
+    TRACE_SCOPE("fill_formula_column");
     if (col < 0 || col >= ncols) return;
+    msheet_materialize();
+    sheet_touch();
     int base_row = cur_row;
     char *base = sheet[base_row][col].data;
     if (!base || base[0] != '=') return;
@@ -280,12 +1144,17 @@ void fill_formula_column(int col) {
 }
 
 // CSV load/save
+void msheet_close();
 void load_csv(const char *filename) {
+    TRACE_SCOPE("parse_csv");
     FILE *f = fopen(filename, "r");
     if (!f) return;
+    msheet_close();
+    sheet_touch();
     char line[4096];
     int row = 0;
     nrows = 0; ncols = 0;
+    for (int j = 0; j < MAX_COLS; j++) col_meta_reset(j);
     while (fgets(line, sizeof(line), f) && row < MAX_ROWS) {
         int col = 0;
         char *token = strtok(line, ",\n");
@@ -293,23 +1162,36 @@ void load_csv(const char *filename) {
             strncpy(sheet[row][col].data, token, CELL_LEN-1);
             sheet[row][col].data[CELL_LEN-1] = '\0';
             sanitize(sheet[row][col].data);
+            // columna nueva: las filas anteriores estaban vacías
+            if (col >= ncols)
+                for (int i = 0; i < row; i++) col_meta_add(col, i, "");
+            col_meta_add(col, row, sheet[row][col].data);
             col++;
             token = strtok(NULL, ",\n");
         }
+        // celdas que faltan en esta fila
+        for (int j = col; j < ncols; j++) col_meta_add(j, row, "");
         if (col > ncols) ncols = col;
         row++;
     }
     nrows = row;
+    for (int j = 0; j < ncols; j++) col_meta_finish(j, nrows);
     fclose(f);
 }
 
 void save_csv(const char *filename) {
+    TRACE_SCOPE("save_csv");
     FILE *f = fopen(filename, "w");
     if (!f) return;
+    msheet_materialize();
     for (int i = 0; i < nrows; i++) {
         for (int j = 0; j < ncols; j++) {
-            if (sheet[i][j].data[0] == '=')
-                fprintf(f, "%.2f", eval_formula(sheet[i][j].data));
+            if (sheet[i][j].data[0] == '=') {
+                double v = formula_value(i, j);
+                if (is_cycle(v)) fprintf(f, "#CYCLE");
+                else if (is_depth(v)) fprintf(f, "#DEPTH");
+                else fprintf(f, "%.2f", v);
+            }
             else
                 fprintf(f, "%s", sheet[i][j].data);
             if (j < ncols - 1) fprintf(f, ",");
@@ -335,90 +1217,3187 @@ void duplicate_col(int pos) {
     }
 }
 
-int main() {
-    initscr();
-    cbreak();
-    noecho();
-    keypad(stdscr, TRUE);
-    memset(sheet, 0, sizeof(sheet));
-    int ch;
-    while (1) {
-        draw_sheet_filtered();
-        ch = getch();
+// --- ESTADÍSTICAS DE COLUMNA ---
+// Una sola pasada sobre los valores de la columna: conteos, min/max, media y
+// desviación (Welford/Chan para poder combinar trozos), distintos aproximados
+// con HyperLogLog y cuantiles aproximados con un sketch KLL. Las columnas
+// grandes se reparten en trozos entre varios hilos y los parciales se unen.
+// El resultado queda cacheado hasta que se edita la columna.
 
-        // --- Navegación tipo Vim ---
-        if (!formula_mode && !edit_mode) {
-            if (last_ch == 'g' && ch == 'g') { cur_row = 0; last_ch = 0; continue; } // gg
-            if (ch == 'G') { cur_row = nrows-1; continue; } // G
-            last_ch = (ch == 'g') ? 'g' : 0;
-
-            switch(ch) {
-                case 'q': endwin(); return 0;
-                case '=': formula_mode = 1; formula_row = cur_row; formula_col = cur_col;
-                          strcpy(formula_buffer, "="); dynamic_pos = 1;
-                          strcpy(sheet[cur_row][cur_col].data, formula_buffer); break;
-                case 'e': edit_mode = 1; strcpy(edit_buffer, sheet[cur_row][cur_col].data); break;
-                case 'c': { echo(); char filename[256];
-                            mvprintw(nrows + 5, 0, "Archivo CSV a cargar: ");
-                            getnstr(filename, 255); noecho(); load_csv(filename);
-                            cur_row = cur_col = 0; break; }
-                case 's': { echo(); char filename[256];
-                            mvprintw(nrows + 5, 0, "Archivo CSV a guardar: ");
-                            getnstr(filename, 255); noecho(); save_csv(filename); break; }
-                case 'h': if(cur_col>0) cur_col--; break;
-                case 'l': if(cur_col<ncols-1) cur_col++; break;
-                case 'k': if(cur_row>0) cur_row--; break;
-                case 'j': if(cur_row<nrows-1) cur_row++; break;
-                case 'i': insert_row(cur_row); break;
-                case 'd': remove_row(cur_row); break;
-                case 'I': insert_col(cur_col); break;
-                case 'D': remove_col(cur_col); break;
-                case 'f': fill_formula_column(cur_col); break;
-                case 'R': duplicate_row(cur_row); break;
-                case 'C': duplicate_col(cur_col); break;
-                case '0': cur_col = 0; break;           // inicio de fila
-                case '$': cur_col = ncols-1; break;     // fin de fila
-                case 'H': cur_col = col_offset; break;  // inicio visible
-                case 'L': cur_col = col_offset + (COLS/12) -1; break; // fin visible
-                case 'F': activate_filter(); break;    // activar filtro
-                case 'U': deactivate_filter(); break;  // quitar filtro
-            }
-        } else if (edit_mode) {
-            if (ch == 27) edit_mode = 0;
-            else if (ch == '\n') {
-                strncpy(sheet[cur_row][cur_col].data, edit_buffer, CELL_LEN-1);
-                sheet[cur_row][cur_col].data[CELL_LEN-1] = '\0';
-                sanitize(sheet[cur_row][cur_col].data);
-                edit_mode = 0;
-                if (cur_row < nrows-1) cur_row++;
-            } else if (ch == KEY_BACKSPACE || ch == 127) {
-                int len = strlen(edit_buffer);
-                if (len > 0) edit_buffer[len-1] = '\0';
-            } else if (ch >= 32 && ch <= 126) {
-                int len = strlen(edit_buffer);
-                if (len < CELL_LEN-1) {
-                    edit_buffer[len] = (char)ch;
-                    edit_buffer[len+1] = '\0';
-                }
-            }
-        } else {
-            if (ch == 27) formula_mode = 0, formula_row = formula_col = -1, dynamic_pos = -1;
-            else if (ch == '\n') formula_mode = 0, formula_row = formula_col = -1, dynamic_pos = -1;
-            else if (ch == 'h' && cur_col>0) { cur_col--; update_dynamic_ref(); }
-            else if (ch == 'l' && cur_col<ncols-1) { cur_col++; update_dynamic_ref(); }
-            else if (ch == 'k' && cur_row>0) { cur_row--; update_dynamic_ref(); }
-            else if (ch == 'j' && cur_row<nrows-1) { cur_row++; update_dynamic_ref(); }
-            else if (ch == '+' || ch == '-' || ch == '*' || ch == '/') {
-                int len = strlen(formula_buffer);
-                if (len < FORMULA_MAX-2) {
-                    formula_buffer[len] = (char)ch;
-                    formula_buffer[len+1] = '\0';
-                    dynamic_pos = len+1;
-                    strcpy(sheet[formula_row][formula_col].data, formula_buffer);
-                }
-            }
+#define STATS_CHUNK 256          // filas por hilo: con MAX_ROWS filas hay hasta 4 trozos
+#define STATS_THREADS 8
+#define HLL_BITS 12
+#define HLL_REGS (1 << HLL_BITS)
+#define KLL_K 200
+#define KLL_LEVELS 30
+
+uint64_t hash64(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) { h ^= p[i]; h *= 1099511628211ULL; }
+    // mezcla final (splitmix64) para repartir bien los bits altos
+    h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+// --- HyperLogLog ---
+typedef struct {
+    unsigned char reg[HLL_REGS];
+} Hll;
+
+void hll_add(Hll *h, uint64_t x) {
+    int idx = x >> (64 - HLL_BITS);
+    uint64_t rest = (x << HLL_BITS) | (1ULL << (HLL_BITS - 1));
+    int rank = __builtin_clzll(rest) + 1;
+    if (rank > h->reg[idx]) h->reg[idx] = rank;
+}
+
+void hll_merge(Hll *a, const Hll *b) {
+    for (int i = 0; i < HLL_REGS; i++)
+        if (b->reg[i] > a->reg[i]) a->reg[i] = b->reg[i];
+}
+
+double hll_estimate(const Hll *h) {
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGS; i++) {
+        sum += ldexp(1.0, -h->reg[i]);
+        if (h->reg[i] == 0) zeros++;
+    }
+    double m = HLL_REGS;
+    double est = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (est <= 2.5 * m && zeros) est = m * log(m / zeros);   // conteo lineal
+    return est;
+}
+
+// --- KLL: cuantiles con memoria acotada ---
+// Cada nivel guarda hasta KLL_K valores de peso 2^nivel; al llenarse se
+// ordena y se sube la mitad de sus elementos (alternando pares/impares).
+typedef struct {
+    double *item[KLL_LEVELS];
+    int size[KLL_LEVELS];
+    int nlevels;
+    long long n;
+    unsigned flip;
+} Kll;
+
+void kll_init(Kll *k) { memset(k, 0, sizeof(Kll)); }
+
+void kll_free(Kll *k) {
+    for (int l = 0; l < KLL_LEVELS; l++) free(k->item[l]);
+    memset(k, 0, sizeof(Kll));
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void kll_push(Kll *k, int level, double v);
+
+static void kll_compact(Kll *k, int level) {
+    if (level + 1 >= KLL_LEVELS) return;
+    double *it = k->item[level];
+    int n = k->size[level];
+    qsort(it, n, sizeof(double), cmp_double);
+    int keep = n & 1;           // con cantidad impar queda uno en el nivel
+    double last = it[n - 1];
+    int off = (k->flip++) & 1;
+    k->size[level] = 0;
+    for (int i = off; i < n - keep; i += 2) kll_push(k, level + 1, it[i]);
+    if (keep) it[k->size[level]++] = last;
+}
+
+static void kll_push(Kll *k, int level, double v) {
+    if (!k->item[level]) {
+        k->item[level] = malloc(2 * KLL_K * sizeof(double));
+        if (!k->item[level]) return;
+    }
+    if (level >= k->nlevels) k->nlevels = level + 1;
+    k->item[level][k->size[level]++] = v;
+    if (k->size[level] >= KLL_K) kll_compact(k, level);
+}
+
+void kll_add(Kll *k, double v) {
+    k->n++;
+    kll_push(k, 0, v);
+}
+
+void kll_merge(Kll *a, const Kll *b) {
+    for (int l = 0; l < b->nlevels; l++)
+        for (int i = 0; i < b->size[l]; i++) kll_push(a, l, b->item[l][i]);
+    a->n += b->n;
+}
+
+typedef struct {
+    double v;
+    long long w;
+} KllItem;
+
+static int cmp_kll_item(const void *a, const void *b) {
+    return cmp_double(&((const KllItem *)a)->v, &((const KllItem *)b)->v);
+}
+
+// Cuantiles qs[0..nq) (crecientes) en out
+void kll_quantiles(const Kll *k, const double *qs, int nq, double *out) {
+    int total = 0;
+    for (int l = 0; l < k->nlevels; l++) total += k->size[l];
+    for (int i = 0; i < nq; i++) out[i] = NAN;
+    if (total == 0) return;
+    KllItem *items = malloc(total * sizeof(KllItem));
+    if (!items) return;
+    int n = 0;
+    long long wsum = 0;
+    for (int l = 0; l < k->nlevels; l++)
+        for (int i = 0; i < k->size[l]; i++) {
+            items[n].v = k->item[l][i];
+            items[n].w = 1LL << l;
+            wsum += items[n++].w;
+        }
+    qsort(items, n, sizeof(KllItem), cmp_kll_item);
+    long long acc = 0;
+    int q = 0;
+    for (int i = 0; i < n && q < nq; i++) {
+        acc += items[i].w;
+        while (q < nq && acc >= qs[q] * wsum) out[q++] = items[i].v;
+    }
+    while (q < nq) out[q++] = items[n - 1].v;
+    free(items);
+}
+
+// --- acumulador por trozo ---
+typedef struct {
+    long long count;     // valores numéricos
+    double min, max;
+    double mean, m2;     // Welford
+    Hll hll;
+    Kll kll;
+} StatAcc;
 
+typedef struct {
+    const double *vals;
+    const uint64_t *hashes;
+    int n;
+    int nhashes;
+    StatAcc acc;
+} StatJob;
+
+typedef double v4d __attribute__((vector_size(32)));
+typedef long long v4i __attribute__((vector_size(32)));
+
+// Une (nb, mb, m2b) en (n, m, m2) (Chan et al. para media/varianza)
+static void moments_merge(long long *n, double *m, double *m2, long long nb, double mb, double m2b) {
+    if (nb == 0) return;
+    long long t = *n + nb;
+    double d = mb - *m;
+    *m += d * nb / t;
+    *m2 += m2b + d * d * *n * nb / t;
+    *n = t;
+}
+
+// Kernel sobre un arreglo contiguo en una sola pasada: 4 carriles con
+// min/max y Welford (media y m2) que se unen al final; el resto va
+// escalar. El mismo recorrido alimenta el KLL, y el HLL del trozo se
+// llena con los hashes que le tocan.
+static void stats_kernel(StatJob *job) {
+    const double *x = job->vals;
+    int n = job->n;
+    StatAcc *a = &job->acc;
+    for (int i = 0; i < job->nhashes; i++) hll_add(&a->hll, job->hashes[i]);
+    if (n == 0) return;
+
+    v4d vmin = { x[0], x[0], x[0], x[0] }, vmax = vmin;
+    v4d vmean = { 0, 0, 0, 0 }, vm2 = { 0, 0, 0, 0 };
+    long long k = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        v4d v;
+        memcpy(&v, x + i, sizeof(v));
+        v4i lt = v < vmin, gt = v > vmax;
+        vmin = (v4d)(((v4i)v & lt) | ((v4i)vmin & ~lt));
+        vmax = (v4d)(((v4i)v & gt) | ((v4i)vmax & ~gt));
+        k++;
+        v4d d = v - vmean;
+        vmean += d / (double)k;
+        vm2 += d * (v - vmean);
+        for (int l = 0; l < 4; l++) kll_add(&a->kll, x[i + l]);
+    }
+    long long cnt = 0;
+    double mn = vmin[0], mx = vmax[0], mean = 0, m2 = 0;
+    for (int l = 0; l < 4; l++) {
+        if (vmin[l] < mn) mn = vmin[l];
+        if (vmax[l] > mx) mx = vmax[l];
+        moments_merge(&cnt, &mean, &m2, k, vmean[l], vm2[l]);
+    }
+    for (; i < n; i++) {
+        if (x[i] < mn) mn = x[i];
+        if (x[i] > mx) mx = x[i];
+        cnt++;
+        double d = x[i] - mean;
+        mean += d / cnt;
+        m2 += d * (x[i] - mean);
+        kll_add(&a->kll, x[i]);
     }
+
+    a->count = n;
+    a->min = mn;
+    a->max = mx;
+    a->mean = mean;
+    a->m2 = m2;
+}
+
+static void *stats_worker(void *arg) {
+    TRACE_SCOPE("stats_worker");
+    StatJob *job = arg;
+    stats_kernel(job);
+    return NULL;
+}
+
+// Une b en a
+static void stat_merge(StatAcc *a, StatAcc *b) {
+    if (b->count) {
+        if (a->count == 0) { a->min = b->min; a->max = b->max; }
+        if (b->min < a->min) a->min = b->min;
+        if (b->max > a->max) a->max = b->max;
+        moments_merge(&a->count, &a->mean, &a->m2, b->count, b->mean, b->m2);
+    }
+    hll_merge(&a->hll, &b->hll);
+    kll_merge(&a->kll, &b->kll);
+}
+
+typedef struct {
+    int valid;
+    unsigned version;     // col_version al calcular
+    unsigned epoch;       // sheet_epoch, si la columna tiene fórmulas
+    int has_formulas;
+    long long count;      // celdas no vacías
+    long long nulls;
+    long long numeric;
+    double min, max, mean, stddev;
+    double distinct;
+    double p50, p90, p99;
+} ColStats;
+
+static ColStats col_stats_cache[MAX_COLS];
+
+// Valor numérico de una celda (evaluando fórmulas); 0 si no es numérica
+int cell_number(int row, int col, double *v) {
+    const char *d = sheet[row][col].data;
+    if (d[0] == '=') {
+        *v = sheet == sheets[cur_sheet].cells ? formula_value(row, col) : eval_formula(d);
+        return 1;
+    }
+    int t = classify_cell(d, v);
+    return t == COL_INT || t == COL_FLOAT;
+}
+
+const ColStats *col_stats(int col) {
+    if (col < 0 || col >= ncols) return NULL;
+    ColStats *cs = &col_stats_cache[col];
+    if (cs->valid && cs->version == col_version[col] && (!cs->has_formulas || cs->epoch == sheet_epoch))
+        return cs;
+
+    ensure_col(col);
+    const ColMeta *meta = col_meta_get(col);
+    int first = meta && meta->header ? 1 : 0;
+
+    // valores numéricos contiguos + hash de cada celda no vacía
+    int n = nrows - first > 0 ? nrows - first : 0;
+    double *vals = malloc((n ? n : 1) * sizeof(double));
+    uint64_t *hashes = malloc((n ? n : 1) * sizeof(uint64_t));
+    if (!vals || !hashes) { free(vals); free(hashes); return NULL; }
+
+    memset(cs, 0, sizeof(ColStats));
+    int nv = 0, nh = 0;
+    for (int i = first; i < nrows; i++) {
+        const char *d = sheet[i][col].data;
+        if (!d[0]) { cs->nulls++; continue; }
+        if (d[0] == '=') cs->has_formulas = 1;
+        double v;
+        if (cell_number(i, col, &v)) {
+            vals[nv++] = v;
+            hashes[nh++] = hash64(&v, sizeof(v));
+        } else {
+            hashes[nh++] = hash64(d, strlen(d));
+        }
+    }
+    cs->count = nh;
+
+    // trozos en paralelo: cada hilo toma su parte de los valores numéricos
+    // y de los hashes (hay al menos tantos hashes como valores)
+    int nchunks = (nh + STATS_CHUNK - 1) / STATS_CHUNK;
+    if (nchunks < 1) nchunks = 1;
+    if (nchunks > STATS_THREADS) nchunks = STATS_THREADS;
+    StatJob jobs[STATS_THREADS];
+    pthread_t th[STATS_THREADS];
+    int per = (nv + nchunks - 1) / nchunks, per_h = (nh + nchunks - 1) / nchunks;
+    for (int t = 0; t < nchunks; t++) {
+        memset(&jobs[t], 0, sizeof(StatJob));
+        int lo = t * per, hi = lo + per < nv ? lo + per : nv;
+        jobs[t].vals = vals + (lo < nv ? lo : nv);
+        jobs[t].n = hi > lo ? hi - lo : 0;
+        lo = t * per_h, hi = lo + per_h < nh ? lo + per_h : nh;
+        jobs[t].hashes = hashes + (lo < nh ? lo : nh);
+        jobs[t].nhashes = hi > lo ? hi - lo : 0;
+        kll_init(&jobs[t].acc.kll);
+        if (nchunks > 1 && pthread_create(&th[t], NULL, stats_worker, &jobs[t]) != 0) {
+            th[t] = 0;
+            stats_kernel(&jobs[t]);
+        } else if (nchunks == 1) {
+            stats_kernel(&jobs[t]);
+        }
+    }
+    StatAcc total;
+    memset(&total, 0, sizeof(total));
+    kll_init(&total.kll);
+    for (int t = 0; t < nchunks; t++) {
+        if (nchunks > 1 && th[t]) pthread_join(th[t], NULL);
+        stat_merge(&total, &jobs[t].acc);
+        kll_free(&jobs[t].acc.kll);
+    }
+
+    cs->numeric = total.count;
+    cs->min = total.min;
+    cs->max = total.max;
+    cs->mean = total.mean;
+    cs->stddev = total.count > 1 ? sqrt(total.m2 / (total.count - 1)) : 0;
+    cs->distinct = nh ? hll_estimate(&total.hll) : 0;
+    double qs[3] = { 0.5, 0.9, 0.99 }, out[3];
+    kll_quantiles(&total.kll, qs, 3, out);
+    cs->p50 = out[0]; cs->p90 = out[1]; cs->p99 = out[2];
+    kll_free(&total.kll);
+    free(vals);
+    free(hashes);
+
+    cs->version = col_version[col];
+    cs->epoch = sheet_epoch;
+    cs->valid = 1;
+    return cs;
+}
+
+// Panel con las estadísticas de la columna actual
+void show_col_stats(int col) {
+    const ColStats *cs = col_stats(col);
+    if (!cs) return;
+    const ColMeta *meta = col_meta_get(col);
+    char name[16];
+    col_name(col, name);
+
+    int h = 14, w = 44;
+    WINDOW *win = newwin(h, w, (LINES - h) / 2, (COLS - w) / 2);
+    if (!win) return;
+    box(win, 0, 0);
+    mvwprintw(win, 0, 2, " Columna %s (%s) ", name, meta ? col_type_name(meta->type) : "?");
+    mvwprintw(win, 1, 2, "Celdas:      %lld", cs->count);
+    mvwprintw(win, 2, 2, "Vacías:      %lld", cs->nulls);
+    mvwprintw(win, 3, 2, "Numéricas:   %lld", cs->numeric);
+    if (cs->numeric) {
+        mvwprintw(win, 4, 2, "Mínimo:      %.4g", cs->min);
+        mvwprintw(win, 5, 2, "Máximo:      %.4g", cs->max);
+        mvwprintw(win, 6, 2, "Media:       %.4g", cs->mean);
+        mvwprintw(win, 7, 2, "Desv. est.:  %.4g", cs->stddev);
+        mvwprintw(win, 9, 2, "p50 / p90 / p99 (aprox.):");
+        mvwprintw(win, 10, 2, "  %.4g / %.4g / %.4g", cs->p50, cs->p90, cs->p99);
+    }
+    mvwprintw(win, 8, 2, "Distintos:   ~%.0f", cs->distinct);
+    mvwprintw(win, h - 2, 2, "(cualquier tecla para cerrar)");
+    wrefresh(win);
+    wgetch(win);
+    delwin(win);
+}
+
+// --- BÚSQUEDAS ENTRE HOJAS ---
+// VLOOKUP(clave, [hoja!]A1:C100, col), XLOOKUP(clave, rango, rango_ret),
+// MATCH(clave, rango) e INDEX(rango, fila[, col]). Las claves se comparan
+// normalizadas (los números por valor). La primera búsqueda sobre una
+// columna construye un índice hash (clave -> filas) que luego se mantiene
+// con cada edición, así cada búsqueda cuesta O(1) y no un recorrido.
+//
+// Con :index B el índice de la columna queda declarado: además del hash
+// lleva un tramo ordenado (valor, fila) para rangos, sobrevive a inserciones
+// y borrados de filas (se desplaza en el sitio) y los filtros lo usan.
+
+#define MAX_LOOKUP_INDEX 32
+
+typedef struct {
+    uint64_t hash;
+    int row;              // -1 libre, -2 borrado
+} IxEntry;
+
+typedef struct {
+    double v;
+    int row;
+} IxRun;
+
+typedef struct {
+    int used;
+    int declared;         // creado con :index
+    int stale;            // reconstruir en el próximo uso
+    int sheet, col;
+    int has_formulas;     // claves calculadas: reconstruir si cambia la hoja
+    unsigned epoch;
+    IxEntry *slot;
+    int cap;              // potencia de 2
+    int live, dead;
+    uint64_t *row_hash;   // hash de la clave de cada fila
+    int nrows;
+    double *row_val;      // valor numérico de cada fila (NAN si no es número)
+    IxRun *run;           // solo declarados: filas numéricas ordenadas por valor
+    int nrun;
+} LookupIndex;
+
+LookupIndex lookup_ix[MAX_LOOKUP_INDEX];
+
+typedef struct {
+    int sheet;
+    int r0, c0, r1, c1;
+} Range;
+
+int sheet_find(const char *name) {
+    for (int k = 0; k < nsheets; k++)
+        if (strcasecmp(sheets[k].name, name) == 0) return k;
+    return -1;
+}
+
+static int sheet_rows(int sh) { return sh == cur_sheet ? nrows : sheets[sh].nrows; }
+
+// Hoja cuya rejilla está en `sheet`: la activa, o la que se evalúa anidada
+static int grid_sheet() {
+    for (int k = 0; k < nsheets; k++)
+        if (sheets[k].cells == sheet) return k;
+    return cur_sheet;
+}
+
+// Celdas de otras hojas en evaluación en este hilo (ver is_cycle)
+static __thread struct { int sheet, row, col; } nest[EVAL_MAX_DEPTH];
+static __thread int nest_n;
+
+// Valor de una celda de cualquier hoja; las fórmulas se evalúan en su hoja
+double sheet_value(int sh, int row, int col) {
+    Cell (*cells)[MAX_COLS] = sh < 0 ? sheet : sheets[sh].cells;
+    if (cells == sheets[cur_sheet].cells) ensure_col(col);
+    if (cells[row][col].data[0] != '=') return atof(cells[row][col].data);
+    // el caché (y la detección de ciclos) es de la hoja activa; las demás
+    // se evalúan anidando, con la hoja cambiada mientras tanto
+    if (cells == sheets[cur_sheet].cells) {
+        Cell (*saved)[MAX_COLS] = sheet;
+        sheet = cells;
+        double v = formula_value(row, col);
+        sheet = saved;
+        return v;
+    }
+    int k = sh < 0 ? grid_sheet() : sh;
+    for (int i = 0; i < nest_n; i++)
+        if (nest[i].sheet == k && nest[i].row == row && nest[i].col == col) return CYCLE_VALUE;
+    if (nest_n == EVAL_MAX_DEPTH) return DEPTH_VALUE;
+    nest[nest_n].sheet = k;
+    nest[nest_n].row = row;
+    nest[nest_n].col = col;
+    nest_n++;
+    Cell (*saved)[MAX_COLS] = sheet;
+    sheet = cells;
+    double v = eval_formula(cells[row][col].data);
+    sheet = saved;
+    nest_n--;
+    return v;
+}
+
+// Texto normalizado de una clave: números por valor, texto tal cual
+static void key_norm(const char *text, char *out, int size) {
+    double v;
+    int t = classify_cell(text, &v);
+    if (t == COL_INT || t == COL_FLOAT) snprintf(out, size, "%.15g", v);
+    else snprintf(out, size, "%s", text);
+}
+
+// Clave normalizada de una celda (de la hoja sh)
+static void cell_key(int sh, int row, int col, char *out, int size) {
+    Cell (*cells)[MAX_COLS] = sh < 0 ? sheet : sheets[sh].cells;
+    const char *d = cells[row][col].data;
+    if (d[0] == '=') snprintf(out, size, "%.15g", sheet_value(sh, row, col));
+    else key_norm(d, out, size);
+}
+
+static uint64_t key_hash(const char *key) { return hash64(key, strlen(key)); }
+
+static void ix_insert(LookupIndex *ix, uint64_t h, int row) {
+    int i = h & (ix->cap - 1);
+    while (ix->slot[i].row >= 0) i = (i + 1) & (ix->cap - 1);
+    if (ix->slot[i].row == -2) ix->dead--;
+    ix->slot[i].hash = h;
+    ix->slot[i].row = row;
+    ix->live++;
+}
+
+static void ix_remove(LookupIndex *ix, uint64_t h, int row) {
+    int i = h & (ix->cap - 1);
+    while (ix->slot[i].row != -1) {
+        if (ix->slot[i].row == row && ix->slot[i].hash == h) {
+            ix->slot[i].row = -2;
+            ix->live--;
+            ix->dead++;
+            return;
+        }
+        i = (i + 1) & (ix->cap - 1);
+    }
+}
+
+// Valor numérico de una clave (fechas como AAAAMMDD); 0 si no es número
+static int cell_key_number(int sh, int row, int col, double *v) {
+    Cell (*cells)[MAX_COLS] = sh < 0 ? sheet : sheets[sh].cells;
+    const char *d = cells[row][col].data;
+    if (d[0] == '=') {
+        *v = sheet_value(sh, row, col);
+        return !isnan(*v);
+    }
+    int t = classify_cell(d, v);
+    return t == COL_INT || t == COL_FLOAT || t == COL_DATE;
+}
+
+static void ix_free(LookupIndex *ix) {
+    free(ix->slot);
+    free(ix->row_hash);
+    free(ix->row_val);
+    free(ix->run);
+    memset(ix, 0, sizeof(LookupIndex));
+}
+
+// Deja solo la declaración: el índice se reconstruye al volver a usarlo
+static void ix_invalidate(LookupIndex *ix) {
+    if (!ix->declared) { ix_free(ix); return; }
+    int sh = ix->sheet, col = ix->col;
+    ix_free(ix);
+    ix->used = ix->declared = ix->stale = 1;
+    ix->sheet = sh;
+    ix->col = col;
+}
+
+static int cmp_ix_run(const void *a, const void *b) {
+    const IxRun *x = a, *y = b;
+    if (x->v != y->v) return x->v < y->v ? -1 : 1;
+    return x->row - y->row;
+}
+
+// Primera posición del tramo con (v, row) >= (v0, row0)
+static int run_lower(const LookupIndex *ix, double v, int row) {
+    int lo = 0, hi = ix->nrun;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const IxRun *e = &ix->run[mid];
+        if (e->v < v || (e->v == v && e->row < row)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void run_insert(LookupIndex *ix, double v, int row) {
+    if (!ix->run || isnan(v)) return;
+    int i = run_lower(ix, v, row);
+    memmove(&ix->run[i + 1], &ix->run[i], (ix->nrun - i) * sizeof(IxRun));
+    ix->run[i].v = v;
+    ix->run[i].row = row;
+    ix->nrun++;
+}
+
+static void run_remove(LookupIndex *ix, double v, int row) {
+    if (!ix->run || isnan(v)) return;
+    int i = run_lower(ix, v, row);
+    if (i >= ix->nrun || ix->run[i].row != row || ix->run[i].v != v) return;
+    memmove(&ix->run[i], &ix->run[i + 1], (ix->nrun - i - 1) * sizeof(IxRun));
+    ix->nrun--;
+}
+
+static int ix_build(LookupIndex *ix, int sh, int col) {
+    int n = sheet_rows(sh);
+    unsigned placeholders = eval_placeholders;
+    int declared = ix->declared;
+    ix->sheet = sh;
+    ix->col = col;
+    ix->nrows = n;
+    ix->stale = 0;
+    ix->cap = 64;
+    while (ix->cap < 2 * MAX_ROWS + 2) ix->cap <<= 1;
+    ix->slot = malloc(ix->cap * sizeof(IxEntry));
+    // capacidad para MAX_ROWS: las inserciones de filas no necesitan realloc
+    ix->row_hash = malloc(MAX_ROWS * sizeof(uint64_t));
+    ix->row_val = malloc(MAX_ROWS * sizeof(double));
+    ix->run = declared ? malloc(MAX_ROWS * sizeof(IxRun)) : NULL;
+    if (!ix->slot || !ix->row_hash || !ix->row_val || (declared && !ix->run)) {
+        ix_free(ix);
+        return -1;
+    }
+    ix->declared = declared;
+    for (int i = 0; i < ix->cap; i++) ix->slot[i].row = -1;
+    ix->live = ix->dead = 0;
+    ix->nrun = 0;
+    ix->has_formulas = 0;
+    Cell (*cells)[MAX_COLS] = sh < 0 ? sheet : sheets[sh].cells;
+    for (int r = 0; r < n; r++) {
+        char key[CELL_LEN];
+        double v;
+        if (cells[r][col].data[0] == '=') ix->has_formulas = 1;
+        cell_key(sh, r, col, key, sizeof(key));
+        ix->row_hash[r] = key_hash(key);
+        ix_insert(ix, ix->row_hash[r], r);
+        ix->row_val[r] = cell_key_number(sh, r, col, &v) ? v : NAN;
+        if (ix->run && !isnan(ix->row_val[r])) {
+            ix->run[ix->nrun].v = v;
+            ix->run[ix->nrun].row = r;
+            ix->nrun++;
+        }
+    }
+    if (ix->run) qsort(ix->run, ix->nrun, sizeof(IxRun), cmp_ix_run);
+    ix->epoch = sheet_epoch;
+    ix->used = 1;
+    // alguna clave valió un 0 provisional (ver eval_cell) o NAN por el plazo
+    // del cuadro: no se guarda
+    if (eval_placeholders != placeholders || eval_aborted) ix->stale = 1;
+    return 0;
+}
+
+// ¿Está el índice de la columna hecho y al día (sin reconstruirlo)?
+static int lookup_index_fresh(int sh, int col) {
+    for (int k = 0; k < MAX_LOOKUP_INDEX; k++) {
+        LookupIndex *ix = &lookup_ix[k];
+        if (ix->used && ix->sheet == sh && ix->col == col)
+            return !ix->stale && !(ix->has_formulas && ix->epoch != sheet_epoch);
+    }
+    return 0;
+}
+
+// ¿Están calculadas todas las claves de la columna? Las fórmulas de la
+// hoja activa sin valor en el caché valdrían 0 al indexarlas
+static int lookup_keys_ready(int sh, int col) {
+    if (sh != cur_sheet) return 1;
+    for (int r = 0; r < sheet_rows(sh); r++)
+        if (sheets[sh].cells[r][col].data[0] == '=' && cached_epoch[r][col] != sheet_epoch) return 0;
+    return 1;
+}
+
+// Índice de la columna si ya existe (sin crearlo)
+LookupIndex *lookup_index_find(int sh, int col) {
+    for (int k = 0; k < MAX_LOOKUP_INDEX; k++) {
+        LookupIndex *ix = &lookup_ix[k];
+        if (!ix->used || ix->sheet != sh || ix->col != col) continue;
+        if (ix->stale || (ix->has_formulas && ix->epoch != sheet_epoch)) {
+            int declared = ix->declared;
+            if (sh == cur_sheet) ensure_col(col);
+            ix_free(ix);
+            ix->declared = declared;
+            if (ix_build(ix, sh, col) != 0) return NULL;
+        }
+        return ix;
+    }
+    return NULL;
+}
+
+LookupIndex *lookup_index_get(int sh, int col) {
+    if (sh == cur_sheet) ensure_col(col);
+    LookupIndex *ix = lookup_index_find(sh, col);
+    if (ix) return ix;
+    for (int k = 0; k < MAX_LOOKUP_INDEX; k++)
+        if (!lookup_ix[k].used) return ix_build(&lookup_ix[k], sh, col) == 0 ? &lookup_ix[k] : NULL;
+    return NULL;
+}
+
+// Edición de una celda de la hoja activa
+void lookup_index_cell_changed(int row, int col) {
+    for (int k = 0; k < MAX_LOOKUP_INDEX; k++) {
+        LookupIndex *ix = &lookup_ix[k];
+        if (!ix->used || ix->stale || ix->sheet != cur_sheet || ix->col != col || row >= ix->nrows) continue;
+        char key[CELL_LEN];
+        double v;
+        if (sheet[row][col].data[0] == '=') ix->has_formulas = 1;
+        cell_key(cur_sheet, row, col, key, sizeof(key));
+        ix_remove(ix, ix->row_hash[row], row);
+        ix->row_hash[row] = key_hash(key);
+        ix_insert(ix, ix->row_hash[row], row);
+        run_remove(ix, ix->row_val[row], row);
+        ix->row_val[row] = cell_key_number(cur_sheet, row, col, &v) ? v : NAN;
+        run_insert(ix, ix->row_val[row], row);
+        // demasiadas marcas de borrado: reconstruir
+        if (ix->dead > ix->cap / 4) ix->stale = 1;
+    }
+}
+
+// Fila nueva en pos (la hoja ya está desplazada): renumerar en el sitio
+void lookup_index_row_inserted(int pos) {
+    for (int k = 0; k < MAX_LOOKUP_INDEX; k++) {
+        LookupIndex *ix = &lookup_ix[k];
+        if (!ix->used || ix->stale || ix->sheet != cur_sheet) continue;
+        // las fórmulas dependen de la posición: no se pueden desplazar
+        if (ix->has_formulas || pos > ix->nrows || ix->nrows >= MAX_ROWS) { ix_invalidate(ix); continue; }
+        for (int i = 0; i < ix->cap; i++)
+            if (ix->slot[i].row >= pos) ix->slot[i].row++;
+        for (int i = 0; i < ix->nrun; i++)
+            if (ix->run[i].row >= pos) ix->run[i].row++;
+        memmove(&ix->row_hash[pos + 1], &ix->row_hash[pos], (ix->nrows - pos) * sizeof(uint64_t));
+        memmove(&ix->row_val[pos + 1], &ix->row_val[pos], (ix->nrows - pos) * sizeof(double));
+        ix->nrows++;
+        ix->row_hash[pos] = key_hash("");
+        ix->row_val[pos] = NAN;
+        ix_insert(ix, ix->row_hash[pos], pos);
+    }
+}
+
+// Fila pos eliminada (la hoja ya está desplazada)
+void lookup_index_row_removed(int pos) {
+    for (int k = 0; k < MAX_LOOKUP_INDEX; k++) {
+        LookupIndex *ix = &lookup_ix[k];
+        if (!ix->used || ix->stale || ix->sheet != cur_sheet) continue;
+        if (ix->has_formulas || pos >= ix->nrows) { ix_invalidate(ix); continue; }
+        ix_remove(ix, ix->row_hash[pos], pos);
+        run_remove(ix, ix->row_val[pos], pos);
+        for (int i = 0; i < ix->cap; i++)
+            if (ix->slot[i].row > pos) ix->slot[i].row--;
+        for (int i = 0; i < ix->nrun; i++)
+            if (ix->run[i].row > pos) ix->run[i].row--;
+        memmove(&ix->row_hash[pos], &ix->row_hash[pos + 1], (ix->nrows - pos - 1) * sizeof(uint64_t));
+        memmove(&ix->row_val[pos], &ix->row_val[pos + 1], (ix->nrows - pos - 1) * sizeof(double));
+        ix->nrows--;
+        if (ix->dead > ix->cap / 4) ix->stale = 1;
+    }
+}
+
+// Columna insertada (delta = 1) o eliminada (delta = -1) en pos
+void lookup_index_col_shifted(int pos, int delta) {
+    for (int k = 0; k < MAX_LOOKUP_INDEX; k++) {
+        LookupIndex *ix = &lookup_ix[k];
+        if (!ix->used || ix->sheet != cur_sheet) continue;
+        if (delta < 0 && ix->col == pos) { ix_free(ix); continue; }
+        if (ix->col > pos || (delta > 0 && ix->col == pos)) ix->col += delta;
+        if (ix->has_formulas) ix_invalidate(ix);
+    }
+}
+
+// Cambio de muchas celdas en la hoja activa: sus índices se reconstruyen al usarlos
+void lookup_index_drop_sheet() {
+    for (int k = 0; k < MAX_LOOKUP_INDEX; k++)
+        if (lookup_ix[k].used && lookup_ix[k].sheet == cur_sheet) ix_invalidate(&lookup_ix[k]);
+}
+
+// Memoria de los índices de búsqueda vivos (ver :mem)
+size_t lookup_index_bytes() {
+    size_t b = 0;
+    for (int k = 0; k < MAX_LOOKUP_INDEX; k++) {
+        LookupIndex *ix = &lookup_ix[k];
+        if (!ix->slot) continue;
+        b += ix->cap * sizeof(IxEntry) + MAX_ROWS * (sizeof(uint64_t) + sizeof(double));
+        if (ix->run) b += MAX_ROWS * sizeof(IxRun);
+    }
+    return b;
+}
+
+// Primera fila en [r0, r1] cuya clave normalizada es key; -1 si no hay.
+// Dentro de eval_cell, mientras haya claves sin calcular el índice no se
+// construye: se recorre el rango, que además solo pide las claves que la
+// búsqueda necesita (no las de toda la columna, que pueden depender de la
+// propia fórmula)
+int lookup_row(int sh, int col, int r0, int r1, const char *key) {
+    if (sh == cur_sheet) ensure_col(col);
+    if (eval_running && !lookup_index_fresh(sh, col) && !lookup_keys_ready(sh, col)) {
+        char k2[CELL_LEN];
+        int rows = sheet_rows(sh);
+        for (int r = r0; r <= r1 && r < rows; r++) {
+            cell_key(sh, r, col, k2, sizeof(k2));
+            if (strcmp(k2, key) == 0) return r;
+        }
+        return -1;
+    }
+    LookupIndex *ix = lookup_index_get(sh, col);
+    if (!ix) return -1;
+    uint64_t h = key_hash(key);
+    int best = -1;
+    int i = h & (ix->cap - 1);
+    while (ix->slot[i].row != -1) {
+        int r = ix->slot[i].row;
+        if (r >= 0 && ix->slot[i].hash == h && r >= r0 && r <= r1 && (best < 0 || r < best)) {
+            char k2[CELL_LEN];
+            cell_key(sh, r, col, k2, sizeof(k2));
+            if (strcmp(k2, key) == 0) best = r;
+        }
+        i = (i + 1) & (ix->cap - 1);
+    }
+    return best;
+}
+
+// Filas de la hoja activa que cumplen "col op operand" (ver FILTROS).
+// Con un índice declarado la igualdad sigue la cadena del hash y los rangos
+// se acotan por búsqueda binaria en el tramo ordenado; si no, recorre.
+int filter_eval(int col, int op, const char *operand, unsigned char *rows) {
+    TRACE_SCOPE("filter");
+    char key[CELL_LEN], k2[CELL_LEN];
+    double x, v;
+    int numeric = classify_cell(operand, &x);
+    numeric = numeric == COL_INT || numeric == COL_FLOAT || numeric == COL_DATE;
+    key_norm(operand, key, sizeof(key));
+    memset(rows, 0, nrows);
+
+    LookupIndex *ix = lookup_index_find(cur_sheet, col);
+    if (ix && ix->declared && op == FILTER_EQ) {
+        uint64_t h = key_hash(key);
+        for (int i = h & (ix->cap - 1); ix->slot[i].row != -1; i = (i + 1) & (ix->cap - 1)) {
+            int r = ix->slot[i].row;
+            if (r < 0 || ix->slot[i].hash != h) continue;
+            cell_key(cur_sheet, r, col, k2, sizeof(k2));
+            rows[r] = strcmp(k2, key) == 0;
+            COUNT(filter_rows, 1);
+        }
+        return 1;
+    }
+    if (ix && ix->declared && op != FILTER_SUBSTR && numeric) {
+        int lo = 0, hi = ix->nrun;
+        if (op == FILTER_GT) lo = run_lower(ix, x, MAX_ROWS);
+        if (op == FILTER_GE) lo = run_lower(ix, x, -1);
+        if (op == FILTER_LT) hi = run_lower(ix, x, -1);
+        if (op == FILTER_LE) hi = run_lower(ix, x, MAX_ROWS);
+        for (int i = lo; i < hi; i++) rows[ix->run[i].row] = 1;
+        COUNT(filter_rows, hi - lo);
+        return 1;
+    }
+
+    COUNT(filter_rows, nrows);
+    for (int r = 0; r < nrows; r++) {
+        const char *d = sheet[r][col].data;
+        switch (op) {
+        case FILTER_SUBSTR:
+            rows[r] = strstr(d, operand) != NULL;
+            break;
+        case FILTER_EQ:
+            cell_key(cur_sheet, r, col, k2, sizeof(k2));
+            rows[r] = strcmp(k2, key) == 0;
+            break;
+        default: {
+            int c;
+            if (numeric) {
+                if (!cell_key_number(cur_sheet, r, col, &v)) break;
+                c = v < x ? -1 : v > x;
+            } else {
+                c = strcmp(d, operand);
+            }
+            rows[r] = op == FILTER_LT ? c < 0 : op == FILTER_LE ? c <= 0
+                    : op == FILTER_GT ? c > 0 : c >= 0;
+        }
+        }
+    }
+    return 0;
+}
+
+static void skip_spaces(const char **s) { while (isspace((unsigned char)**s)) (*s)++; }
+
+static int expect(const char **s, char c) {
+    skip_spaces(s);
+    if (**s != c) return 0;
+    (*s)++;
+    return 1;
+}
+
+// [hoja!]A1:C100, [hoja!]A:C o una sola celda
+static int parse_range(const char **s, Range *rg) {
+    char id[32];
+    skip_spaces(s);
+    rg->sheet = grid_sheet();
+    read_ident(s, id, sizeof(id));
+    if (**s == '!') {
+        (*s)++;
+        rg->sheet = sheet_find(id);
+        if (rg->sheet < 0) return 0;
+        read_ident(s, id, sizeof(id));
+    }
+    char id2[32] = "";
+    if (**s == ':') {
+        (*s)++;
+        read_ident(s, id2, sizeof(id2));
+    } else {
+        strcpy(id2, id);
+    }
+    int rows = sheet_rows(rg->sheet);
+    if (parse_cell(id, &rg->r0, &rg->c0) && parse_cell(id2, &rg->r1, &rg->c1)) return 1;
+    // columnas completas
+    rg->c0 = col_from_name(id);
+    rg->c1 = col_from_name(id2);
+    rg->r0 = 0;
+    rg->r1 = rows - 1;
+    return rg->c0 >= 0 && rg->c1 >= 0;
+}
+
+// Clave de búsqueda: "texto", una celda (su texto) o una expresión
+static void parse_key(const char **s, char *out, int size) {
+    skip_spaces(s);
+    if (**s == '"') {
+        (*s)++;
+        int j = 0;
+        char raw[CELL_LEN];
+        while (**s && **s != '"') {
+            if (j < CELL_LEN - 1) raw[j++] = **s;
+            (*s)++;
+        }
+        raw[j] = '\0';
+        if (**s == '"') (*s)++;
+        key_norm(raw, out, size);
+        return;
+    }
+    const char *start = *s;
+    char id[32];
+    int sh = cur_sheet, r, c;
+    read_ident(s, id, sizeof(id));
+    if (**s == '!') {
+        (*s)++;
+        sh = sheet_find(id);
+        read_ident(s, id, sizeof(id));
+    }
+    const char *after = *s;
+    skip_spaces(&after);
+    if (sh >= 0 && (*after == ',' || *after == ')') && parse_cell(id, &r, &c)) {
+        *s = after;
+        cell_key(sh, r, c, out, size);
+        return;
+    }
+    *s = start;
+    snprintf(out, size, "%.15g", eval_expr(s));
+}
+
+double eval_function(const char *name, const char **s) {
+    char key[CELL_LEN];
+    Range rg, rg2;
+    double res = NAN;
+
+    if (strcasecmp(name, "VLOOKUP") == 0) {
+        parse_key(s, key, sizeof(key));
+        if (!expect(s, ',') || !parse_range(s, &rg) || !expect(s, ',')) goto end;
+        int k = (int)eval_expr(s);
+        if (expect(s, ',')) eval_expr(s);   // solo coincidencia exacta
+        int r = lookup_row(rg.sheet, rg.c0, rg.r0, rg.r1, key);
+        if (r >= 0 && k >= 1 && rg.c0 + k - 1 < MAX_COLS) res = sheet_value(rg.sheet, r, rg.c0 + k - 1);
+    } else if (strcasecmp(name, "XLOOKUP") == 0) {
+        parse_key(s, key, sizeof(key));
+        if (!expect(s, ',') || !parse_range(s, &rg) || !expect(s, ',') || !parse_range(s, &rg2)) goto end;
+        int r = lookup_row(rg.sheet, rg.c0, rg.r0, rg.r1, key);
+        if (r >= 0 && rg2.r0 + (r - rg.r0) < MAX_ROWS) res = sheet_value(rg2.sheet, rg2.r0 + (r - rg.r0), rg2.c0);
+    } else if (strcasecmp(name, "MATCH") == 0) {
+        parse_key(s, key, sizeof(key));
+        if (!expect(s, ',') || !parse_range(s, &rg)) goto end;
+        if (expect(s, ',')) eval_expr(s);
+        int r = lookup_row(rg.sheet, rg.c0, rg.r0, rg.r1, key);
+        if (r >= 0) res = r - rg.r0 + 1;
+    } else if (strcasecmp(name, "INDEX") == 0) {
+        if (!parse_range(s, &rg) || !expect(s, ',')) goto end;
+        int i = (int)eval_expr(s), j = 1;
+        if (expect(s, ',')) j = (int)eval_expr(s);
+        int r = rg.r0 + i - 1, c = rg.c0 + j - 1;
+        if (i >= 1 && j >= 1 && r <= rg.r1 && c <= rg.c1) res = sheet_value(rg.sheet, r, c);
+    }
+
+end:
+    // saltar lo que quede hasta el ')' de la llamada
+    for (int depth = 0; **s; (*s)++) {
+        if (**s == '(') depth++;
+        else if (**s == ')' && depth-- == 0) { (*s)++; break; }
+    }
+    return res;
+}
+
+// --- MSHEET: formato binario nativo ---
+//
+// [cabecera][chunk col 0]...[chunk col N-1][índice de chunks]
+//
+// Cada chunk de columna guarda, para sus filas: tipo de celda, valor numérico
+// (el número o el resultado cacheado de la fórmula) y desplazamiento a un heap
+// de cadenas con el texto o la plantilla de la fórmula. Las plantillas usan
+// referencias relativas (R[dr]C[dc]) para que una columna rellenada con 'f'
+// comparta una sola cadena. Abrir solo mapea el archivo y lee el índice; cada
+// columna se decodifica la primera vez que se necesita.
+
+#define MSHEET_MAGIC "MSHEET\0\1"
+#define MSHEET_VERSION 1
+
+enum { MS_EMPTY = 0, MS_NUM = 1, MS_TEXT = 2, MS_FORMULA = 3 };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nrows;
+    uint32_t ncols;
+    uint32_t reserved;
+    uint64_t index_off;
+} MsHeader;
+
+typedef struct {
+    uint64_t off;
+    uint64_t len;
+} MsIndexEntry;
+
+typedef struct {
+    uint32_t nrows;
+    uint32_t heap_len;
+} MsChunkHeader;
+
+// archivo mapeado actualmente abierto
+static const unsigned char *ms_map = NULL;
+static size_t ms_map_len = 0;
+static const MsIndexEntry *ms_index = NULL;
+static int ms_ncols = 0;
+static int ms_pending_count = 0;
+static unsigned char ms_pending[MAX_COLS];
+static unsigned ms_epoch = 0;  // los resultados cacheados solo valen si no hubo cambios
+static Cell (*ms_cells)[MAX_COLS] = NULL;  // hoja en la que se decodifica
+
+static size_t align8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+// "=A1+B2" en (r,c) -> "=R[..]C[..]+R[..]C[..]"
+static void formula_to_template(const char *f, int row, int col, char *out, int size) {
+    COUNT(templates, 1);
+    int pos = 0;
+    while (*f && pos < size - 1) {
+        if (isalpha((unsigned char)*f)) {
+            char ref[16]; int j = 0;
+            while ((isalpha((unsigned char)*f) || isdigit((unsigned char)*f)) && j < 15) ref[j++] = *f++;
+            ref[j] = '\0';
+            int r, c;
+            // en hoja!A1 el nombre de la hoja puede parecer una celda (S1)
+            if (*f != '!' && parse_cell(ref, &r, &c))
+                pos += snprintf(out + pos, size - pos, "R[%d]C[%d]", r - row, c - col);
+            else
+                pos += snprintf(out + pos, size - pos, "%s", ref);
+        } else {
+            out[pos++] = *f++;
+        }
+    }
+    if (pos > size - 1) pos = size - 1;
+    out[pos] = '\0';
+}
+
+static void template_to_formula(const char *t, int row, int col, char *out, int size) {
+    int pos = 0;
+    while (*t && pos < size - 1) {
+        int dr, dc, n = 0;
+        if (t[0] == 'R' && t[1] == '[' && sscanf(t, "R[%d]C[%d]%n", &dr, &dc, &n) == 2 && n > 0) {
+            char ref[16];
+            cell_name(row + dr, col + dc, ref);
+            pos += snprintf(out + pos, size - pos, "%s", ref);
+            t += n;
+        } else {
+            out[pos++] = *t++;
+        }
+    }
+    if (pos > size - 1) pos = size - 1;
+    out[pos] = '\0';
+}
+
+// Número que sobrevive el viaje texto -> double -> texto
+static int is_plain_number(const char *s, double *v) {
+    char *end, buf[32];
+    if (!s[0]) return 0;
+    *v = strtod(s, &end);
+    if (*end) return 0;
+    snprintf(buf, sizeof(buf), "%.15g", *v);
+    return strcmp(buf, s) == 0;
+}
+
+static uint32_t fnv1a(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+static int write_col_chunk(FILE *f, int col) {
+    int n = nrows;
+    unsigned char *kind = calloc(n ? n : 1, 1);
+    double *value = calloc(n ? n : 1, sizeof(double));
+    uint32_t *soff = calloc(n ? n : 1, sizeof(uint32_t));
+    size_t heap_cap = 4096, heap_len = 0;
+    char *heap = malloc(heap_cap);
+    // tabla para deduplicar cadenas del heap
+    int slots = 16;
+    while (slots < 2 * n) slots <<= 1;
+    int64_t *dedup = malloc(slots * sizeof(int64_t));
+    if (!kind || !value || !soff || !heap || !dedup) {
+        free(kind); free(value); free(soff); free(heap); free(dedup);
+        return -1;
+    }
+    for (int i = 0; i < slots; i++) dedup[i] = -1;
+
+    for (int i = 0; i < n; i++) {
+        const char *d = sheet[i][col].data;
+        char str[FORMULA_MAX * 2];
+        if (!d[0]) { kind[i] = MS_EMPTY; continue; }
+        if (d[0] == '=') {
+            kind[i] = MS_FORMULA;
+            value[i] = formula_value(i, col);
+            formula_to_template(d, i, col, str, sizeof(str));
+        } else if (is_plain_number(d, &value[i])) {
+            kind[i] = MS_NUM;
+            continue;
+        } else {
+            kind[i] = MS_TEXT;
+            snprintf(str, sizeof(str), "%s", d);
+        }
+
+        uint32_t h = fnv1a(str) & (slots - 1);
+        while (dedup[h] >= 0 && strcmp(heap + dedup[h], str) != 0) h = (h + 1) & (slots - 1);
+        if (dedup[h] < 0) {
+            size_t len = strlen(str) + 1;
+            if (heap_len + len > heap_cap) {
+                while (heap_len + len > heap_cap) heap_cap *= 2;
+                char *nh = realloc(heap, heap_cap);
+                if (!nh) { free(kind); free(value); free(soff); free(heap); free(dedup); return -1; }
+                heap = nh;
+            }
+            memcpy(heap + heap_len, str, len);
+            dedup[h] = heap_len;
+            heap_len += len;
+        }
+        soff[i] = (uint32_t)dedup[h];
+    }
+
+    static const char zeros[8];
+    MsChunkHeader ch = { (uint32_t)n, (uint32_t)heap_len };
+    fwrite(&ch, sizeof(ch), 1, f);
+    fwrite(kind, 1, n, f);
+    fwrite(zeros, 1, align8(sizeof(ch) + n) - (sizeof(ch) + n), f);
+    fwrite(value, sizeof(double), n, f);
+    fwrite(soff, sizeof(uint32_t), n, f);
+    fwrite(heap, 1, heap_len, f);
+    size_t tail = (size_t)n * sizeof(uint32_t) + heap_len;
+    fwrite(zeros, 1, align8(tail) - tail, f);
+
+    free(kind); free(value); free(soff); free(heap); free(dedup);
+    return ferror(f) ? -1 : 0;
+}
+
+// Se escribe en un temporal del mismo directorio y se renombra al final,
+// así un fallo a medias no deja el archivo destino truncado
+int save_msheet(const char *filename) {
+    TRACE_SCOPE("save_msheet");
+    msheet_materialize();
+    char tmpname[1024];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmpXXXXXX", filename);
+    int fd = mkstemp(tmpname);
+    if (fd < 0) return -1;
+    // mkstemp crea con 0600: el renombrado conserva los permisos del original
+    struct stat st;
+    fchmod(fd, stat(filename, &st) == 0 ? (st.st_mode & 07777) : 0644);
+    FILE *f = fdopen(fd, "wb");
+    if (!f) { close(fd); unlink(tmpname); return -1; }
+
+    MsHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MSHEET_MAGIC, 8);
+    h.version = MSHEET_VERSION;
+    h.nrows = nrows;
+    h.ncols = ncols;
+    fwrite(&h, sizeof(h), 1, f);
+
+    MsIndexEntry *index = calloc(ncols ? ncols : 1, sizeof(MsIndexEntry));
+    if (!index) { fclose(f); unlink(tmpname); return -1; }
+    for (int j = 0; j < ncols; j++) {
+        index[j].off = ftell(f);
+        if (write_col_chunk(f, j) < 0) { free(index); fclose(f); unlink(tmpname); return -1; }
+        index[j].len = ftell(f) - index[j].off;
+    }
+    h.index_off = ftell(f);
+    fwrite(index, sizeof(MsIndexEntry), ncols, f);
+    free(index);
+
+    fseek(f, 0, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, f);
+    int err = ferror(f);
+    if (fclose(f) != 0) err = 1;
+    if (err || rename(tmpname, filename) < 0) {
+        unlink(tmpname);
+        return -1;
+    }
+    return 0;
+}
+
+void msheet_close() {
+    if (ms_map) munmap((void *)ms_map, ms_map_len);
+    ms_map = NULL;
+    ms_map_len = 0;
+    ms_index = NULL;
+    ms_ncols = 0;
+    ms_pending_count = 0;
+    memset(ms_pending, 0, sizeof(ms_pending));
+}
+
+static void decode_col(int col) {
+    TRACE_SCOPE("decode_col");
+    ms_pending[col] = 0;
+    ms_pending_count--;
+
+    const unsigned char *base = ms_map + ms_index[col].off;
+    const MsChunkHeader *ch = (const MsChunkHeader *)base;
+    int n = ch->nrows;
+    const unsigned char *kind = base + sizeof(*ch);
+    const double *value = (const double *)(base + align8(sizeof(*ch) + n));
+    const uint32_t *soff = (const uint32_t *)(value + n);
+    const char *heap = (const char *)(soff + n);
+
+    for (int i = 0; i < n && i < MAX_ROWS; i++) {
+        char *d = ms_cells[i][col].data;
+        switch (kind[i]) {
+            case MS_NUM:
+                snprintf(d, CELL_LEN, "%.15g", value[i]);
+                break;
+            case MS_TEXT:
+                strncpy(d, heap + soff[i], CELL_LEN - 1);
+                d[CELL_LEN - 1] = '\0';
+                break;
+            case MS_FORMULA:
+                template_to_formula(heap + soff[i], i, col, d, CELL_LEN);
+                if (sheet_epoch == ms_epoch) {
+                    cached_val[i][col] = value[i];
+                    cached_epoch[i][col] = sheet_epoch;
+                }
+                break;
+            default:
+                d[0] = '\0';
+        }
+    }
+
+    search_index_col_decoded(col);
+    // todo decodificado: ya no hace falta el mapeo
+    if (ms_pending_count == 0) msheet_close();
+}
+
+// Comprueba que el chunk de una columna cabe en el mapeo y que sus
+// desplazamientos apuntan dentro de un heap terminado en '\0'; así
+// decode_col no necesita más comprobaciones
+static int chunk_valid(const unsigned char *map, size_t map_len, const MsIndexEntry *e, uint32_t rows) {
+    if (e->off % 8 || e->off > map_len || e->len > map_len - e->off || e->len < sizeof(MsChunkHeader))
+        return 0;
+    const unsigned char *base = map + e->off;
+    const MsChunkHeader *ch = (const MsChunkHeader *)base;
+    uint64_t n = ch->nrows;
+    if (n != rows) return 0;
+    uint64_t need = align8(sizeof(*ch) + n) + n * (sizeof(double) + sizeof(uint32_t)) + ch->heap_len;
+    if (need > e->len) return 0;
+    const uint32_t *soff = (const uint32_t *)(base + align8(sizeof(*ch) + n) + n * sizeof(double));
+    const char *heap = (const char *)(soff + n);
+    const unsigned char *kind = base + sizeof(*ch);
+    if (ch->heap_len && heap[ch->heap_len - 1] != '\0') return 0;
+    for (uint64_t i = 0; i < n; i++)
+        if ((kind[i] == MS_TEXT || kind[i] == MS_FORMULA) && soff[i] >= ch->heap_len) return 0;
+    return 1;
+}
+
+// Columna col de la hoja activa (la única con columnas sin decodificar:
+// sheet_switch materializa), aunque `sheet` apunte a otra hoja mientras se
+// evalúa una referencia cruzada
+void ensure_col(int col) {
+    if (ms_pending_count && col >= 0 && col < ms_ncols && ms_pending[col]) decode_col(col);
+}
+
+int col_decoded(int col) {
+    return !(ms_pending_count && col >= 0 && col < ms_ncols && ms_pending[col]);
+}
+
+void msheet_materialize() {
+    for (int j = 0; j < ms_ncols && ms_pending_count; j++) ensure_col(j);
+}
+
+int load_msheet(const char *filename) {
+    TRACE_SCOPE("load_msheet");
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(MsHeader)) { close(fd); return -1; }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const MsHeader *h = map;
+    if (memcmp(h->magic, MSHEET_MAGIC, 8) != 0 || h->version != MSHEET_VERSION ||
+        h->nrows > MAX_ROWS || h->ncols > MAX_COLS ||
+        h->index_off % 8 || h->index_off > (uint64_t)st.st_size ||
+        (uint64_t)h->ncols * sizeof(MsIndexEntry) > (uint64_t)st.st_size - h->index_off) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    const MsIndexEntry *index = (const MsIndexEntry *)((const unsigned char *)map + h->index_off);
+    for (uint32_t j = 0; j < h->ncols; j++)
+        if (!chunk_valid(map, st.st_size, &index[j], h->nrows)) {
+            munmap(map, st.st_size);
+            return -1;
+        }
+
+    msheet_close();
+    sheet_touch();
+    ms_map = map;
+    ms_map_len = st.st_size;
+    ms_index = index;
+    nrows = h->nrows;
+    ncols = h->ncols;
+    ms_ncols = ncols;
+    ms_epoch = sheet_epoch;
+    ms_cells = sheet;
+    for (int j = 0; j < ncols; j++) ms_pending[j] = 1;
+    ms_pending_count = ncols;
+    if (ms_pending_count == 0) msheet_close();
+    return 0;
+}
+
+static int is_msheet(const char *filename) {
+    size_t n = strlen(filename);
+    return n > 7 && strcmp(filename + n - 7, ".msheet") == 0;
+}
+
+void load_file(const char *filename) {
+    TRACE_SCOPE("load");
+    if (is_msheet(filename)) load_msheet(filename);
+    else load_csv(filename);
+}
+
+void save_file(const char *filename) {
+    TRACE_SCOPE("save");
+    if (is_msheet(filename)) save_msheet(filename);
+    else save_csv(filename);
+}
+
+// --- COMANDOS (:) ---
+
+void set_status(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(status_msg, sizeof(status_msg), fmt, ap);
+    va_end(ap);
+}
+
+// Nombre visible de una columna: su encabezado si lo tiene, si no la letra
+void col_title(int col, char *buf, int size) {
+    const ColMeta *meta = col_meta_get(col);
+    if (meta && meta->header && sheet[0][col].data[0]) {
+        snprintf(buf, size, "%s", sheet[0][col].data);
+    } else {
+        char name[16];
+        col_name(col, name);
+        snprintf(buf, size, "%s", name);
+    }
+}
+
+int num_threads() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > 8) n = 8;
+    return (int)n;
+}
+
+// --- GROUP BY ---
+// :groupby <col> sum(<col>) count() avg(<col>) min(<col>) max(<col>)
+// Agregación por hash: cada hilo agrega su tramo de filas en una tabla
+// propia y después las tablas parciales se unen en una sola. Los valores
+// de las columnas agregadas se calculan antes en el hilo principal (las
+// fórmulas pueden cambiar `sheet` mientras evalúan otra hoja), así los
+// hilos solo leen la rejilla de origen y esos valores.
+
+#define GB_MAX_AGG 16
+#define GB_ROWS_PER_THREAD 256    // con MAX_ROWS filas hay hasta 4 tablas parciales
+
+enum { AGG_COUNT, AGG_SUM, AGG_AVG, AGG_MIN, AGG_MAX };
+
+typedef struct {
+    int op;
+    int col;
+} AggSpec;
+
+typedef struct {
+    uint64_t hash;
+    const char *key;      // apunta al texto de la celda clave
+    int first_row;
+    long long count;
+    double acc[GB_MAX_AGG];
+    long long n[GB_MAX_AGG];
+} GroupEntry;
+
+typedef struct {
+    GroupEntry *slot;
+    int cap;              // potencia de 2
+    int used;
+} GroupTable;
+
+typedef struct {
+    Cell (*cells)[MAX_COLS];  // hoja de origen
+    int key_col;
+    const AggSpec *aggs;
+    int naggs;
+    const double *val;    // val[fila * naggs + a]; NAN si la celda no es número
+    int lo, hi;           // filas [lo, hi)
+    GroupTable table;
+} GroupJob;
+
+static int gt_init(GroupTable *t, int cap) {
+    t->cap = 64;
+    while (t->cap < cap * 2) t->cap <<= 1;
+    t->used = 0;
+    t->slot = calloc(t->cap, sizeof(GroupEntry));
+    return t->slot ? 0 : -1;
+}
+
+static int gt_grow(GroupTable *t);
+
+static GroupEntry *gt_find(GroupTable *t, uint64_t h, const char *key, int row, const AggSpec *aggs, int naggs) {
+    if ((t->used + 1) * 2 > t->cap && gt_grow(t) < 0) return NULL;
+    int i = h & (t->cap - 1);
+    while (t->slot[i].key) {
+        if (t->slot[i].hash == h && strcmp(t->slot[i].key, key) == 0) return &t->slot[i];
+        i = (i + 1) & (t->cap - 1);
+    }
+    GroupEntry *e = &t->slot[i];
+    e->hash = h;
+    e->key = key;
+    e->first_row = row;
+    for (int a = 0; a < naggs; a++) {
+        if (aggs[a].op == AGG_MIN) e->acc[a] = INFINITY;
+        else if (aggs[a].op == AGG_MAX) e->acc[a] = -INFINITY;
+    }
+    t->used++;
+    return e;
+}
+
+static int gt_grow(GroupTable *t) {
+    GroupTable nt;
+    nt.cap = t->cap * 2;
+    nt.used = t->used;
+    nt.slot = calloc(nt.cap, sizeof(GroupEntry));
+    if (!nt.slot) return -1;
+    for (int i = 0; i < t->cap; i++) {
+        if (!t->slot[i].key) continue;
+        int j = t->slot[i].hash & (nt.cap - 1);
+        while (nt.slot[j].key) j = (j + 1) & (nt.cap - 1);
+        nt.slot[j] = t->slot[i];
+    }
+    free(t->slot);
+    *t = nt;
+    return 0;
+}
+
+static void agg_update(GroupEntry *e, const AggSpec *aggs, int naggs, const double *val) {
+    e->count++;
+    for (int a = 0; a < naggs; a++) {
+        if (aggs[a].op == AGG_COUNT) continue;
+        double v = val[a];
+        if (isnan(v)) continue;
+        switch (aggs[a].op) {
+            case AGG_SUM: case AGG_AVG: e->acc[a] += v; break;
+            case AGG_MIN: if (v < e->acc[a]) e->acc[a] = v; break;
+            case AGG_MAX: if (v > e->acc[a]) e->acc[a] = v; break;
+        }
+        e->n[a]++;
+    }
+}
+
+static void agg_combine(GroupEntry *e, const GroupEntry *p, const AggSpec *aggs, int naggs) {
+    e->count += p->count;
+    if (p->first_row < e->first_row) e->first_row = p->first_row;
+    for (int a = 0; a < naggs; a++) {
+        switch (aggs[a].op) {
+            case AGG_SUM: case AGG_AVG: e->acc[a] += p->acc[a]; break;
+            case AGG_MIN: if (p->acc[a] < e->acc[a]) e->acc[a] = p->acc[a]; break;
+            case AGG_MAX: if (p->acc[a] > e->acc[a]) e->acc[a] = p->acc[a]; break;
+        }
+        e->n[a] += p->n[a];
+    }
+}
+
+static void *groupby_worker(void *arg) {
+    TRACE_SCOPE("groupby_worker");
+    GroupJob *job = arg;
+    for (int i = job->lo; i < job->hi; i++) {
+        const char *key = job->cells[i][job->key_col].data;
+        uint64_t h = hash64(key, strlen(key));
+        GroupEntry *e = gt_find(&job->table, h, key, i, job->aggs, job->naggs);
+        if (e) agg_update(e, job->aggs, job->naggs, job->val + (size_t)i * job->naggs);
+    }
+    return NULL;
+}
+
+static int cmp_group_row(const void *a, const void *b) {
+    return (*(GroupEntry *const *)a)->first_row - (*(GroupEntry *const *)b)->first_row;
+}
+
+static int parse_agg(const char *tok, AggSpec *spec) {
+    static const char *names[] = { "count", "sum", "avg", "min", "max" };
+    char fn[16], arg[16] = "";
+    if (sscanf(tok, "%15[a-zA-Z](%15[^)])", fn, arg) < 1 || !strchr(tok, '(')) return -1;
+    for (int op = 0; op < 5; op++) {
+        if (strcasecmp(fn, names[op]) != 0) continue;
+        spec->op = op;
+        spec->col = op == AGG_COUNT ? -1 : col_from_name(arg);
+        if (op != AGG_COUNT && (spec->col < 0 || spec->col >= ncols)) return -1;
+        return 0;
+    }
+    return -1;
+}
+
+void cmd_groupby(char *args) {
+    AggSpec aggs[GB_MAX_AGG];
+    int naggs = 0;
+    char *tok = strtok(args, " \t");
+    int key_col = tok ? col_from_name(tok) : -1;
+    if (key_col < 0 || key_col >= ncols) {
+        set_status("Uso: :groupby <col> sum(<col>) count() avg(<col>) min(<col>) max(<col>)");
+        return;
+    }
+    while ((tok = strtok(NULL, " \t")) && naggs < GB_MAX_AGG) {
+        if (parse_agg(tok, &aggs[naggs]) < 0) {
+            set_status("Agregado no válido: %s", tok);
+            return;
+        }
+        naggs++;
+    }
+    if (naggs == 0) aggs[naggs++].op = AGG_COUNT;
+
+    msheet_materialize();
+    // encabezado si lo tiene la clave o cualquier columna agregada
+    const ColMeta *meta = col_meta_get(key_col);
+    int first = meta && meta->header ? 1 : 0;
+    for (int a = 0; a < naggs; a++) {
+        meta = aggs[a].col >= 0 ? col_meta_get(aggs[a].col) : NULL;
+        if (meta && meta->header) first = 1;
+    }
+    int rows = nrows - first;
+
+    double *val = malloc(((size_t)nrows * naggs + 1) * sizeof(double));
+    if (!val) { set_status("Sin memoria"); return; }
+    for (int i = first; i < nrows; i++)
+        for (int a = 0; a < naggs; a++) {
+            double v = NAN;
+            if (aggs[a].op != AGG_COUNT && !cell_number(i, aggs[a].col, &v)) v = NAN;
+            val[(size_t)i * naggs + a] = v;
+        }
+
+    // tablas parciales por hilo
+    int nthreads = rows / GB_ROWS_PER_THREAD + 1;
+    if (nthreads > num_threads()) nthreads = num_threads();
+    GroupJob jobs[8];
+    pthread_t th[8];
+    int per = (rows + nthreads - 1) / nthreads;
+    int started = 0, oom = 0;
+    for (int t = 0; t < nthreads; t++) {
+        GroupJob *j = &jobs[t];
+        j->cells = sheet;
+        j->key_col = key_col;
+        j->aggs = aggs;
+        j->naggs = naggs;
+        j->val = val;
+        j->lo = first + t * per;
+        j->hi = j->lo + per < nrows ? j->lo + per : nrows;
+        if (gt_init(&j->table, 1024) < 0) { oom = 1; break; }
+        started++;
+        if (nthreads == 1 || pthread_create(&th[t], NULL, groupby_worker, j) != 0) {
+            th[t] = 0;
+            groupby_worker(j);
+        }
+    }
+
+    GroupTable total = { NULL, 0, 0 };
+    if (!oom && gt_init(&total, 1024) < 0) oom = 1;
+    for (int t = 0; t < started; t++) {
+        if (nthreads > 1 && th[t]) pthread_join(th[t], NULL);
+        GroupTable *pt = &jobs[t].table;
+        for (int i = 0; i < pt->cap && !oom; i++) {
+            GroupEntry *p = &pt->slot[i];
+            if (!p->key) continue;
+            GroupEntry *e = gt_find(&total, p->hash, p->key, p->first_row, aggs, naggs);
+            if (e) agg_combine(e, p, aggs, naggs);
+        }
+        free(pt->slot);
+    }
+    free(val);
+    if (oom) { free(total.slot); set_status("Sin memoria"); return; }
+
+    // grupos en orden de primera aparición
+    int ngroups = total.used;
+    GroupEntry **order = malloc((ngroups ? ngroups : 1) * sizeof(GroupEntry *));
+    if (!order) { free(total.slot); set_status("Sin memoria"); return; }
+    int k = 0;
+    for (int i = 0; i < total.cap; i++) if (total.slot[i].key) order[k++] = &total.slot[i];
+    qsort(order, ngroups, sizeof(GroupEntry *), cmp_group_row);
+
+    // encabezados antes de cambiar de hoja
+    static const char *names[] = { "count", "sum", "avg", "min", "max" };
+    char titles[GB_MAX_AGG + 1][CELL_LEN];
+    char name[CELL_LEN];
+    // con encabezado, la fila 0 nombra también las columnas de texto
+    col_title(key_col, titles[0], CELL_LEN);
+    if (first && sheet[0][key_col].data[0]) snprintf(titles[0], CELL_LEN, "%s", sheet[0][key_col].data);
+    snprintf(name, sizeof(name), "groupby %.20s", titles[0]);
+    for (int a = 0; a < naggs; a++) {
+        char arg[CELL_LEN] = "";
+        if (aggs[a].col >= 0) col_title(aggs[a].col, arg, sizeof(arg));
+        if (aggs[a].col >= 0 && first && sheet[0][aggs[a].col].data[0])
+            snprintf(arg, sizeof(arg), "%s", sheet[0][aggs[a].col].data);
+        snprintf(titles[a + 1], CELL_LEN, "%s(%.48s)", names[aggs[a].op], arg);
+    }
+
+    // hoja de resultados; la activa sigue siendo la de origen
+    int out_rows = ngroups + 1 < MAX_ROWS ? ngroups + 1 : MAX_ROWS;
+    int idx = sheet_new(name);
+    if (idx < 0) {
+        free(order); free(total.slot);
+        set_status("No se pudo crear la hoja de resultados");
+        return;
+    }
+    Cell (*res)[MAX_COLS] = sheets[idx].cells;
+    for (int c = 0; c <= naggs; c++) memcpy(res[0][c].data, titles[c], CELL_LEN);
+    for (int g = 0; g + 1 < out_rows; g++) {
+        GroupEntry *e = order[g];
+        snprintf(res[g + 1][0].data, CELL_LEN, "%s", e->key);
+        for (int a = 0; a < naggs; a++) {
+            double v;
+            switch (aggs[a].op) {
+                case AGG_COUNT: v = e->count; break;
+                case AGG_AVG: v = e->n[a] ? e->acc[a] / e->n[a] : 0; break;
+                default: v = e->n[a] ? e->acc[a] : 0;
+            }
+            snprintf(res[g + 1][a + 1].data, CELL_LEN, "%.15g", v);
+        }
+    }
+    free(order);
+    free(total.slot);
+
+    sheets[idx].nrows = out_rows;
+    sheets[idx].ncols = naggs + 1;
+    sheet_switch(idx);
+    set_status("%d grupos%s", ngroups, ngroups + 1 > MAX_ROWS ? " (truncado a MAX_ROWS)" : "");
+}
+
+void cmd_open(char *args);
+
+// --- FILAS DUPLICADAS Y DIFERENCIAS ---
+// :dedup [cols] elimina las filas repetidas (en las columnas dadas o en
+// todas) y :diff otro.csv compara la hoja con un archivo. Ambos calculan un
+// hash de 64 bits por fila, repartido entre hilos, y buscan en una tabla
+// hash; si dos hashes coinciden se comparan las celdas.
+
+#define RH_ROWS_PER_THREAD 8192
+
+typedef struct {
+    Cell (*cells)[MAX_COLS];
+    const int *cols;
+    int ncols;
+    int lo, hi;
+    uint64_t *out;
+} RowHashJob;
+
+static uint64_t row_hash(Cell (*cells)[MAX_COLS], int row, const int *cols, int n) {
+    uint64_t h = 0x9E3779B97F4A7C15ull;
+    for (int k = 0; k < n; k++) {
+        const char *d = cells[row][cols[k]].data;
+        h ^= hash64(d, strlen(d)) + k;
+        h = (h << 27 | h >> 37) * 0x94D049BB133111EBull;
+    }
+    return h;
+}
+
+static void *row_hash_worker(void *arg) {
+    TRACE_SCOPE("row_hash_worker");
+    RowHashJob *job = arg;
+    for (int i = job->lo; i < job->hi; i++)
+        job->out[i] = row_hash(job->cells, i, job->cols, job->ncols);
+    return NULL;
+}
+
+// Hash de las filas [0, rows) de cells en out
+static void row_hashes(Cell (*cells)[MAX_COLS], int rows, const int *cols, int n, uint64_t *out) {
+    int nthreads = rows / RH_ROWS_PER_THREAD + 1;
+    if (nthreads > num_threads()) nthreads = num_threads();
+    RowHashJob jobs[8];
+    pthread_t th[8];
+    int per = (rows + nthreads - 1) / nthreads;
+    for (int t = 0; t < nthreads; t++) {
+        RowHashJob *j = &jobs[t];
+        j->cells = cells;
+        j->cols = cols;
+        j->ncols = n;
+        j->lo = t * per < rows ? t * per : rows;
+        j->hi = j->lo + per < rows ? j->lo + per : rows;
+        j->out = out;
+        if (nthreads == 1 || pthread_create(&th[t], NULL, row_hash_worker, j) != 0) {
+            th[t] = 0;
+            row_hash_worker(j);
+        }
+    }
+    for (int t = 0; t < nthreads; t++)
+        if (nthreads > 1 && th[t]) pthread_join(th[t], NULL);
+}
+
+static int rows_equal(Cell (*a)[MAX_COLS], int ra, Cell (*b)[MAX_COLS], int rb, const int *cols, int n) {
+    for (int k = 0; k < n; k++)
+        if (strcmp(a[ra][cols[k]].data, b[rb][cols[k]].data) != 0) return 0;
+    return 1;
+}
+
+// Tabla hash -> fila; las filas con el mismo hash quedan en la misma secuencia
+typedef struct {
+    IxEntry *slot;
+    int cap;
+} RowTable;
+
+static int rt_init(RowTable *t, int rows) {
+    t->cap = 64;
+    while (t->cap < rows * 2 + 2) t->cap <<= 1;
+    t->slot = malloc(t->cap * sizeof(IxEntry));
+    if (!t->slot) return -1;
+    for (int i = 0; i < t->cap; i++) t->slot[i].row = -1;
+    return 0;
+}
+
+static void rt_insert(RowTable *t, uint64_t h, int row) {
+    int i = h & (t->cap - 1);
+    while (t->slot[i].row != -1) i = (i + 1) & (t->cap - 1);
+    t->slot[i].hash = h;
+    t->slot[i].row = row;
+}
+
+// Columnas "A C" o "A,C"; sin columnas, todas
+static int parse_cols(char *args, int *cols) {
+    int n = 0;
+    for (char *tok = strtok(args, " ,\t"); tok; tok = strtok(NULL, " ,\t")) {
+        int c = col_from_name(tok);
+        if (c < 0 || c >= ncols) return -1;
+        cols[n++] = c;
+    }
+    if (n == 0)
+        for (; n < ncols; n++) cols[n] = n;
+    return n;
+}
+
+void cmd_dedup(char *args) {
+    static int cols[MAX_COLS];
+    int n = parse_cols(args, cols);
+    if (n < 0) { set_status("Uso: :dedup [col ...]"); return; }
+    msheet_materialize();
+    int first = 0;
+    for (int k = 0; k < n; k++) {
+        const ColMeta *meta = col_meta_get(cols[k]);
+        if (meta && meta->header) first = 1;
+    }
+
+    uint64_t *h = malloc((nrows ? nrows : 1) * sizeof(uint64_t));
+    RowTable t;
+    if (!h || rt_init(&t, nrows) < 0) { free(h); set_status("Sin memoria"); return; }
+    row_hashes(sheet, nrows, cols, n, h);
+
+    int out = first;
+    for (int i = first; i < nrows; i++) {
+        int dup = 0;
+        for (int k = h[i] & (t.cap - 1); t.slot[k].row != -1; k = (k + 1) & (t.cap - 1))
+            if (t.slot[k].hash == h[i] && rows_equal(sheet, t.slot[k].row, sheet, i, cols, n)) { dup = 1; break; }
+        if (dup) continue;
+        if (out != i) memcpy(sheet[out], sheet[i], sizeof(Cell) * MAX_COLS);
+        rt_insert(&t, h[i], out);
+        out++;
+    }
+    free(t.slot);
+    free(h);
+    int removed = nrows - out;
+    for (int i = out; i < nrows; i++) memset(sheet[i], 0, sizeof(Cell) * MAX_COLS);
+    nrows = out > 0 ? out : 1;
+    if (cur_row >= nrows) cur_row = nrows - 1;
+    sheet_touch();
+    set_status("%d filas duplicadas eliminadas", removed);
+}
+
+typedef struct {
+    int row;              // fila en su hoja
+    char side;            // '-' solo en la hoja, '+' solo en el archivo
+} DiffRow;
+
+static int cmp_diff_row(const void *a, const void *b) {
+    const DiffRow *x = a, *y = b;
+    if (x->row != y->row) return x->row - y->row;
+    return x->side == '-' ? -1 : y->side == '-';
+}
+
+// :diff otro.csv abre el archivo en una hoja y deja las diferencias (filas
+// que solo están en un lado, como multiconjunto) en una hoja "diff"
+void cmd_diff(char *args) {
+    static int cols[MAX_COLS];
+    while (isspace((unsigned char)*args)) args++;
+    if (access(args, R_OK) != 0) { set_status("No se puede abrir: %s", args); return; }
+    if (nsheets + 2 > MAX_SHEETS) { set_status("No quedan hojas libres"); return; }
+    int a = cur_sheet;
+    char file[256];
+    snprintf(file, sizeof(file), "%s", args);
+    cmd_open(file);
+    int b = cur_sheet;
+    sheet_switch(a);
+    int na = nrows, nb = sheets[b].nrows;
+    int n = ncols > sheets[b].ncols ? ncols : sheets[b].ncols;
+    for (int k = 0; k < n; k++) cols[k] = k;
+    Cell (*ca)[MAX_COLS] = sheet, (*cb)[MAX_COLS] = sheets[b].cells;
+
+    uint64_t *ha = malloc((na + 1) * sizeof(uint64_t));
+    uint64_t *hb = malloc((nb + 1) * sizeof(uint64_t));
+    unsigned char *used = calloc(nb + 1, 1);
+    DiffRow *d = malloc((na + nb + 1) * sizeof(DiffRow));
+    RowTable t = { NULL, 0 };
+    if (!ha || !hb || !used || !d || rt_init(&t, nb) < 0) {
+        free(ha); free(hb); free(used); free(d); free(t.slot);
+        set_status("Sin memoria");
+        return;
+    }
+    row_hashes(ca, na, cols, n, ha);
+    row_hashes(cb, nb, cols, n, hb);
+    for (int i = 0; i < nb; i++) rt_insert(&t, hb[i], i);
+
+    // cada fila de la hoja consume una fila igual del archivo
+    int nd = 0;
+    for (int i = 0; i < na; i++) {
+        int match = -1;
+        for (int k = ha[i] & (t.cap - 1); t.slot[k].row != -1; k = (k + 1) & (t.cap - 1)) {
+            int r = t.slot[k].row;
+            if (!used[r] && t.slot[k].hash == ha[i] && rows_equal(ca, i, cb, r, cols, n)) { match = r; break; }
+        }
+        if (match >= 0) used[match] = 1;
+        else d[nd].row = i, d[nd++].side = '-';
+    }
+    for (int r = 0; r < nb; r++)
+        if (!used[r]) d[nd].row = r, d[nd++].side = '+';
+    qsort(d, nd, sizeof(DiffRow), cmp_diff_row);
+
+    char name[32];
+    snprintf(name, sizeof(name), "diff %.20s", sheets[b].name);
+    int idx = sheet_new(name);
+    if (idx < 0) {
+        free(ha); free(hb); free(used); free(d); free(t.slot);
+        set_status("No se pudo crear la hoja de resultados");
+        return;
+    }
+    Cell (*res)[MAX_COLS] = sheets[idx].cells;
+    int out_cols = n + 2 < MAX_COLS ? n + 2 : MAX_COLS;
+    strcpy(res[0][0].data, "cambio");
+    strcpy(res[0][1].data, "fila");
+    for (int c = 2; c < out_cols; c++) col_title(c - 2, res[0][c].data, CELL_LEN);
+    int out_rows = nd + 1 < MAX_ROWS ? nd + 1 : MAX_ROWS;
+    for (int k = 0; k + 1 < out_rows; k++) {
+        Cell (*src)[MAX_COLS] = d[k].side == '-' ? ca : cb;
+        res[k + 1][0].data[0] = d[k].side;
+        snprintf(res[k + 1][1].data, CELL_LEN, "%d", d[k].row + 1);
+        for (int c = 2; c < out_cols; c++) res[k + 1][c] = src[d[k].row][c - 2];
+    }
+    int removed = 0, added = 0;
+    for (int k = 0; k < nd; k++) {
+        if (d[k].side == '-') removed++;
+        else added++;
+    }
+    free(ha); free(hb); free(used); free(d); free(t.slot);
+
+    sheets[idx].nrows = out_rows;
+    sheets[idx].ncols = out_cols;
+    sheet_switch(idx);
+    set_status("%d filas solo en %s, %d solo en %s%s", removed, sheets[a].name, added, sheets[b].name,
+               nd + 1 > MAX_ROWS ? " (truncado a MAX_ROWS)" : "");
+}
+
+// --- TOP-K Y CUANTILES ---
+// :top N C [archivo], :bottom N C [archivo] y :quantile C q... [archivo]
+// recorren la columna una sola vez con memoria acotada: un montículo de N
+// elementos para top/bottom y un KLL para los cuantiles. Con archivo se lee
+// línea a línea sin cargarlo, así sirve para CSV mayores que la memoria.
+
+typedef void (*ValueFn)(void *ctx, double v, long row);
+
+// Valores numéricos de la columna (hoja activa o archivo); -1 si no abre
+static long scan_values(const char *file, int col, ValueFn fn, void *ctx) {
+    long n = 0;
+    double v;
+    if (!file) {
+        ensure_col(col);
+        for (int i = 0; i < nrows; i++)
+            if (cell_number(i, col, &v) && !isnan(v)) fn(ctx, v, i + 1), n++;
+        return n;
+    }
+    FILE *f = fopen(file, "r");
+    if (!f) return -1;
+    char *line = NULL;
+    size_t cap = 0;
+    long line_no = 0;
+    // mismas columnas que load_csv; getline: las líneas largas no se parten
+    while (getline(&line, &cap, f) != -1) {
+        line_no++;
+        char *tok = strtok(line, ",\n");
+        for (int c = 0; tok && c < col; c++) tok = strtok(NULL, ",\n");
+        if (!tok) continue;
+        sanitize(tok);
+        int t = classify_cell(tok, &v);
+        if (t == COL_INT || t == COL_FLOAT) fn(ctx, v, line_no), n++;
+    }
+    free(line);
+    fclose(f);
+    return n;
+}
+
+typedef struct {
+    double v;             // valor * sign: la raíz es el menor
+    long row;
+} TopItem;
+
+typedef struct {
+    TopItem *item;
+    int n, k;
+    int sign;             // 1 top, -1 bottom
+} TopHeap;
+
+static void top_sift_down(TopHeap *h, int i) {
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < h->n && h->item[l].v < h->item[m].v) m = l;
+        if (r < h->n && h->item[r].v < h->item[m].v) m = r;
+        if (m == i) return;
+        TopItem t = h->item[i]; h->item[i] = h->item[m]; h->item[m] = t;
+        i = m;
+    }
+}
+
+static void top_push(void *ctx, double v, long row) {
+    TopHeap *h = ctx;
+    v *= h->sign;
+    if (h->n < h->k) {
+        int i = h->n++;
+        h->item[i].v = v;
+        h->item[i].row = row;
+        while (i > 0 && h->item[(i - 1) / 2].v > h->item[i].v) {
+            TopItem t = h->item[i]; h->item[i] = h->item[(i - 1) / 2]; h->item[(i - 1) / 2] = t;
+            i = (i - 1) / 2;
+        }
+    } else if (v > h->item[0].v) {
+        h->item[0].v = v;
+        h->item[0].row = row;
+        top_sift_down(h, 0);
+    }
+}
+
+static int cmp_top_item(const void *a, const void *b) {
+    const TopItem *x = a, *y = b;
+    if (x->v != y->v) return x->v > y->v ? -1 : 1;
+    return x->row < y->row ? -1 : x->row > y->row;
+}
+
+// Separa "col" y "archivo" opcional de los argumentos
+static char *arg_file(char *tok) {
+    char *end;
+    if (!tok) return NULL;
+    strtod(tok, &end);
+    return *end ? tok : NULL;
+}
+
+void cmd_topk(char *args, int sign) {
+    const char *usage = sign > 0 ? "Uso: :top N col [archivo]" : "Uso: :bottom N col [archivo]";
+    char *tn = strtok(args, " \t"), *tc = strtok(NULL, " \t"), *file = strtok(NULL, " \t");
+    int k = tn ? atoi(tn) : 0;
+    int col = tc ? col_from_name(tc) : -1;
+    if (k <= 0 || col < 0 || (!file && col >= ncols)) { set_status("%s", usage); return; }
+    if (k > MAX_ROWS - 1) k = MAX_ROWS - 1;
+
+    TopHeap h = { malloc(k * sizeof(TopItem)), 0, k, sign };
+    if (!h.item) { set_status("Sin memoria"); return; }
+    long n = scan_values(file, col, top_push, &h);
+    if (n < 0) { free(h.item); set_status("No se puede abrir: %s", file); return; }
+    qsort(h.item, h.n, sizeof(TopItem), cmp_top_item);
+
+    char name[32], title[CELL_LEN];
+    snprintf(name, sizeof(name), "%s %d %.8s", sign > 0 ? "top" : "bottom", k, tc);
+    if (file) snprintf(title, sizeof(title), "%s", tc);
+    else col_title(col, title, sizeof(title));
+    int idx = sheet_new(name);
+    if (idx < 0) { free(h.item); set_status("No se pudo crear la hoja de resultados"); return; }
+    Cell (*res)[MAX_COLS] = sheets[idx].cells;
+    strcpy(res[0][0].data, file ? "línea" : "fila");
+    memcpy(res[0][1].data, title, CELL_LEN);
+    for (int i = 0; i < h.n; i++) {
+        snprintf(res[i + 1][0].data, CELL_LEN, "%ld", h.item[i].row);
+        snprintf(res[i + 1][1].data, CELL_LEN, "%.15g", h.item[i].v * sign);
+    }
+    sheets[idx].nrows = h.n + 1;
+    sheets[idx].ncols = 2;
+    free(h.item);
+    sheet_switch(idx);
+    set_status("%d de %ld valores", h.n, n);
+}
+
+static void kll_push_value(void *ctx, double v, long row) {
+    (void)row;
+    kll_add(ctx, v);
+}
+
+void cmd_quantile(char *args) {
+    double qs[8], sorted[8], out[8];
+    int nq = 0;
+    char *tc = strtok(args, " \t"), *tok, *file = NULL;
+    int col = tc ? col_from_name(tc) : -1;
+    while ((tok = strtok(NULL, " \t"))) {
+        if ((file = arg_file(tok))) break;
+        if (nq < 8) qs[nq++] = atof(tok);
+    }
+    if (nq == 0) qs[nq++] = 0.5;
+    if (col < 0 || (!file && col >= ncols)) { set_status("Uso: :quantile col q... [archivo]"); return; }
+    for (int i = 0; i < nq; i++)
+        if (qs[i] < 0 || qs[i] > 1) { set_status("Cuantil fuera de [0, 1]: %g", qs[i]); return; }
+
+    Kll k;
+    kll_init(&k);
+    long n = scan_values(file, col, kll_push_value, &k);
+    if (n < 0) { set_status("No se puede abrir: %s", file); return; }
+    // kll_quantiles pide los cuantiles en orden creciente
+    memcpy(sorted, qs, nq * sizeof(double));
+    qsort(sorted, nq, sizeof(double), cmp_double);
+    kll_quantiles(&k, sorted, nq, out);
+    kll_free(&k);
+
+    char msg[256];
+    int len = snprintf(msg, sizeof(msg), "%s (%ld valores):", tc, n);
+    for (int i = 0; i < nq && len < (int)sizeof(msg); i++)
+        for (int j = 0; j < nq; j++)
+            if (sorted[j] == qs[i]) {
+                len += snprintf(msg + len, sizeof(msg) - len, " p%g=%.6g", qs[i] * 100, out[j]);
+                break;
+            }
+    set_status("%s", msg);
+}
+
+// --- CONSULTAS (:select) ---
+// :select A, C where B > 10 and D = x order by C desc limit 20 [into f.csv]
+// Se ejecuta por lotes de SEL_BATCH filas: cada condición decodifica su
+// columna del lote a un vector de números y reduce un vector de selección
+// (índices de las filas que siguen vivas) con un bucle sin saltos; las
+// filas que sobreviven se ordenan, se limitan y se proyectan en una hoja
+// nueva o en un CSV.
+
+#define SEL_BATCH 1024
+#define SEL_MAX_PRED 16
+#define SEL_MAX_TOK 96
+
+enum { SOP_EQ, SOP_NE, SOP_LT, SOP_LE, SOP_GT, SOP_GE };
+
+typedef struct {
+    int col, op;
+    int numeric;          // compara como número; si no, como texto
+    double num;
+    char text[CELL_LEN];
+} SelPred;
+
+typedef struct {
+    double num[SEL_BATCH];
+    unsigned char isnum[SEL_BATCH];
+} ColBatch;
+
+// Palabras, "texto", operadores (<, <=, =, !=, ...) y comas sueltas
+static int sel_tokenize(const char *s, char tok[][CELL_LEN], int max) {
+    int n = 0;
+    while (*s && n < max) {
+        if (isspace((unsigned char)*s)) { s++; continue; }
+        int j = 0;
+        if (*s == '"') {
+            for (s++; *s && *s != '"'; s++) if (j < CELL_LEN - 1) tok[n][j++] = *s;
+            if (*s) s++;
+        } else if (strchr("<>=!,", *s)) {
+            tok[n][j++] = *s++;
+            if (*s == '=' && tok[n][0] != ',') tok[n][j++] = *s++;
+        } else {
+            while (*s && !isspace((unsigned char)*s) && !strchr("<>=!,\"", *s))
+                if (j < CELL_LEN - 1) tok[n][j++] = *s++;
+                else s++;
+        }
+        tok[n++][j] = '\0';
+    }
+    return n;
+}
+
+static void batch_load(int col, int r0, int n, ColBatch *b) {
+    for (int i = 0; i < n; i++) b->isnum[i] = cell_key_number(cur_sheet, r0 + i, col, &b->num[i]);
+}
+
+// Reduce sel (índices dentro del lote) a las filas que cumplen p
+static int pred_apply(const SelPred *p, int r0, int *sel, int nsel, ColBatch *b) {
+    int out = 0;
+    double x = p->num;
+    if (p->numeric) {
+        switch (p->op) {
+            case SOP_EQ: for (int i = 0; i < nsel; i++) { int k = sel[i]; sel[out] = k; out += b->isnum[k] & (b->num[k] == x); } break;
+            case SOP_NE: for (int i = 0; i < nsel; i++) { int k = sel[i]; sel[out] = k; out += b->isnum[k] & (b->num[k] != x); } break;
+            case SOP_LT: for (int i = 0; i < nsel; i++) { int k = sel[i]; sel[out] = k; out += b->isnum[k] & (b->num[k] < x); } break;
+            case SOP_LE: for (int i = 0; i < nsel; i++) { int k = sel[i]; sel[out] = k; out += b->isnum[k] & (b->num[k] <= x); } break;
+            case SOP_GT: for (int i = 0; i < nsel; i++) { int k = sel[i]; sel[out] = k; out += b->isnum[k] & (b->num[k] > x); } break;
+            case SOP_GE: for (int i = 0; i < nsel; i++) { int k = sel[i]; sel[out] = k; out += b->isnum[k] & (b->num[k] >= x); } break;
+        }
+        return out;
+    }
+    for (int i = 0; i < nsel; i++) {
+        int k = sel[i];
+        int c = strcmp(sheet[r0 + k][p->col].data, p->text);
+        int ok = p->op == SOP_EQ ? c == 0 : p->op == SOP_NE ? c != 0 : p->op == SOP_LT ? c < 0
+               : p->op == SOP_LE ? c <= 0 : p->op == SOP_GT ? c > 0 : c >= 0;
+        sel[out] = k;
+        out += ok;
+    }
+    return out;
+}
+
+// Clave de orden de cada fila resultante (qsort no admite contexto)
+static double *sel_key_num;
+static unsigned char *sel_key_isnum;
+static int sel_order_col, sel_desc;
+
+static int cmp_sel_row(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    int c;
+    if (sel_key_isnum[x] && sel_key_isnum[y])
+        c = sel_key_num[x] < sel_key_num[y] ? -1 : sel_key_num[x] > sel_key_num[y];
+    else if (sel_key_isnum[x] != sel_key_isnum[y])
+        c = sel_key_isnum[x] ? -1 : 1;    // números antes que texto
+    else
+        c = strcmp(sheet[x][sel_order_col].data, sheet[y][sel_order_col].data);
+    if (sel_desc) c = -c;
+    return c ? c : x - y;
+}
+
+static int sel_op(const char *t) {
+    static const char *ops[] = { "=", "!=", "<", "<=", ">", ">=" };
+    for (int i = 0; i < 6; i++) if (strcmp(t, ops[i]) == 0) return i;
+    if (strcmp(t, "==") == 0) return SOP_EQ;
+    return -1;
+}
+
+void cmd_select(char *args) {
+    static char tok[SEL_MAX_TOK][CELL_LEN];
+    static int cols[MAX_COLS];
+    SelPred preds[SEL_MAX_PRED];
+    int ncols_out = 0, npreds = 0, order_col = -1, desc = 0, limit = -1;
+    const char *into = NULL;
+    int n = sel_tokenize(args, tok, SEL_MAX_TOK), t = 0;
+    const char *usage = "Uso: :select cols [where c op v [and ...]] [order by c [desc]] [limit n] [into f.csv]";
+
+    // columnas
+    for (; t < n && strcasecmp(tok[t], "where") && strcasecmp(tok[t], "order")
+           && strcasecmp(tok[t], "limit") && strcasecmp(tok[t], "into"); t++) {
+        if (strcmp(tok[t], ",") == 0) continue;
+        if (strcmp(tok[t], "*") == 0) {
+            for (int c = 0; c < ncols && ncols_out < MAX_COLS; c++) cols[ncols_out++] = c;
+            continue;
+        }
+        int c = col_from_name(tok[t]);
+        if (c < 0 || c >= ncols) { set_status("Columna inválida: %s", tok[t]); return; }
+        cols[ncols_out++] = c;
+    }
+    if (ncols_out == 0) { set_status("%s", usage); return; }
+    if (t < n && strcasecmp(tok[t], "where") == 0) {
+        do {
+            t++;
+            if (t + 2 >= n) { set_status("%s", usage); return; }
+            SelPred *p = &preds[npreds];
+            p->col = col_from_name(tok[t]);
+            p->op = sel_op(tok[t + 1]);
+            if (p->col < 0 || p->col >= ncols || p->op < 0 || npreds >= SEL_MAX_PRED) { set_status("%s", usage); return; }
+            snprintf(p->text, sizeof(p->text), "%s", tok[t + 2]);
+            int ty = classify_cell(p->text, &p->num);
+            p->numeric = ty == COL_INT || ty == COL_FLOAT || ty == COL_DATE;
+            npreds++;
+            t += 3;
+        } while (t < n && strcasecmp(tok[t], "and") == 0);
+    }
+    if (t < n && strcasecmp(tok[t], "order") == 0) {
+        if (t + 2 >= n || strcasecmp(tok[t + 1], "by") != 0) { set_status("%s", usage); return; }
+        order_col = col_from_name(tok[t + 2]);
+        if (order_col < 0 || order_col >= ncols) { set_status("Columna inválida: %s", tok[t + 2]); return; }
+        t += 3;
+        if (t < n && (strcasecmp(tok[t], "desc") == 0 || strcasecmp(tok[t], "asc") == 0)) desc = strcasecmp(tok[t++], "desc") == 0;
+    }
+    if (t < n && strcasecmp(tok[t], "limit") == 0) {
+        if (t + 1 >= n) { set_status("%s", usage); return; }
+        limit = atoi(tok[t + 1]);
+        t += 2;
+    }
+    if (t < n && strcasecmp(tok[t], "into") == 0 && t + 1 < n) into = tok[t + 1], t += 2;
+    if (t < n) { set_status("No se entiende: %s", tok[t]); return; }
+
+    msheet_materialize();
+    int first = 0;
+    for (int k = 0; k < ncols_out; k++) {
+        const ColMeta *meta = col_meta_get(cols[k]);
+        if (meta && meta->header) first = 1;
+    }
+
+    // filtro por lotes
+    int *rows = malloc((nrows + 1) * sizeof(int));
+    ColBatch *b = malloc(sizeof(ColBatch));
+    if (!rows || !b) { free(rows); free(b); set_status("Sin memoria"); return; }
+    int nres = 0, sel[SEL_BATCH];
+    for (int r0 = first; r0 < nrows; r0 += SEL_BATCH) {
+        int len = nrows - r0 < SEL_BATCH ? nrows - r0 : SEL_BATCH;
+        int nsel = len;
+        for (int i = 0; i < len; i++) sel[i] = i;
+        for (int p = 0; p < npreds && nsel > 0; p++) {
+            if (preds[p].numeric) batch_load(preds[p].col, r0, len, b);
+            nsel = pred_apply(&preds[p], r0, sel, nsel, b);
+        }
+        for (int i = 0; i < nsel; i++) rows[nres++] = r0 + sel[i];
+    }
+
+    // orden: claves decodificadas una vez por fila
+    if (order_col >= 0 && nres > 1) {
+        sel_key_num = malloc(nrows * sizeof(double));
+        sel_key_isnum = malloc(nrows);
+        if (sel_key_num && sel_key_isnum) {
+            for (int r0 = 0; r0 < nrows; r0 += SEL_BATCH) {
+                int len = nrows - r0 < SEL_BATCH ? nrows - r0 : SEL_BATCH;
+                batch_load(order_col, r0, len, b);
+                memcpy(sel_key_num + r0, b->num, len * sizeof(double));
+                memcpy(sel_key_isnum + r0, b->isnum, len);
+            }
+            sel_order_col = order_col;
+            sel_desc = desc;
+            qsort(rows, nres, sizeof(int), cmp_sel_row);
+        }
+        free(sel_key_num);
+        free(sel_key_isnum);
+    }
+    free(b);
+    if (limit >= 0 && nres > limit) nres = limit;
+
+    if (into) {
+        char title[CELL_LEN];
+        FILE *f = fopen(into, "w");
+        if (!f) { free(rows); set_status("No se puede escribir: %s", into); return; }
+        for (int k = 0; k < ncols_out; k++) {
+            col_title(cols[k], title, sizeof(title));
+            fprintf(f, "%s%s", title, k < ncols_out - 1 ? "," : "\n");
+        }
+        for (int i = 0; i < nres; i++)
+            for (int k = 0; k < ncols_out; k++) {
+                const char *d = sheet[rows[i]][cols[k]].data;
+                if (d[0] == '=') fprintf(f, "%.15g", formula_value(rows[i], cols[k]));
+                else fprintf(f, "%s", d);
+                fprintf(f, k < ncols_out - 1 ? "," : "\n");
+            }
+        fclose(f);
+        free(rows);
+        set_status("%d filas escritas en %s", nres, into);
+        return;
+    }
+
+    int idx = sheet_new("select");
+    if (idx < 0) { free(rows); set_status("No se pudo crear la hoja de resultados"); return; }
+    Cell (*res)[MAX_COLS] = sheets[idx].cells;
+    int out_rows = nres + 1 < MAX_ROWS ? nres + 1 : MAX_ROWS;
+    for (int k = 0; k < ncols_out; k++) col_title(cols[k], res[0][k].data, CELL_LEN);
+    for (int i = 0; i + 1 < out_rows; i++)
+        for (int k = 0; k < ncols_out; k++) {
+            const char *d = sheet[rows[i]][cols[k]].data;
+            if (d[0] == '=') snprintf(res[i + 1][k].data, CELL_LEN, "%.15g", formula_value(rows[i], cols[k]));
+            else res[i + 1][k] = sheet[rows[i]][cols[k]];
+        }
+    free(rows);
+    sheets[idx].nrows = out_rows;
+    sheets[idx].ncols = ncols_out;
+    sheet_switch(idx);
+    set_status("%d filas", nres);
+}
+
+// Nombre de hoja a partir del archivo: datos/ventas.csv -> ventas
+void sheet_name_from_file(const char *filename, char *out, int size) {
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    int j = 0;
+    for (; base[j] && base[j] != '.' && j < size - 1; j++)
+        out[j] = isalnum((unsigned char)base[j]) ? base[j] : '_';
+    out[j] = '\0';
+}
+
+// Abre un archivo en una hoja nueva
+void cmd_open(char *args) {
+    while (isspace((unsigned char)*args)) args++;
+    if (access(args, R_OK) != 0) { set_status("No se puede abrir: %s", args); return; }
+    char name[32];
+    sheet_name_from_file(args, name, sizeof(name));
+    int idx = sheet_new(name);
+    if (idx < 0) { set_status("No se pudo crear la hoja"); return; }
+    sheet_switch(idx);
+    load_file(args);
+    cur_row = cur_col = 0;
+    set_status("Hoja %d: %s (%d filas)", idx + 1, name, nrows);
+}
+
+void cmd_sheet(char *args) {
+    int n = atoi(args);
+    if (n < 1 || n > nsheets) { set_status("Hoja inexistente: %s", args); return; }
+    sheet_switch(n - 1);
+}
+
+// :index B declara un índice sobre la columna (hash + orden); sin argumento
+// lista los declarados
+void cmd_index(const char *args) {
+    char name[16];
+    while (isspace((unsigned char)*args)) args++;
+    if (!*args) {
+        char list[200] = "";
+        int len = 0;
+        for (int k = 0; k < MAX_LOOKUP_INDEX; k++) {
+            LookupIndex *ix = &lookup_ix[k];
+            if (!ix->used || !ix->declared || ix->sheet != cur_sheet) continue;
+            col_name(ix->col, name);
+            len += snprintf(list + len, sizeof(list) - len, " %s", name);
+            if (len >= (int)sizeof(list)) break;
+        }
+        set_status(list[0] ? "Índices:%s" : "Sin índices declarados%s", list);
+        return;
+    }
+    int col = col_from_name(args);
+    if (col < 0 || col >= ncols) { set_status("Columna inválida: %s", args); return; }
+    LookupIndex *ix = lookup_index_find(cur_sheet, col);
+    if (ix && !ix->declared) {
+        ix->declared = 1;
+        ix->stale = 1;    // falta el tramo ordenado
+    }
+    if (!ix) {
+        for (int k = 0; k < MAX_LOOKUP_INDEX && !ix; k++)
+            if (!lookup_ix[k].used) ix = &lookup_ix[k];
+        if (!ix) { set_status("Demasiados índices (máx. %d)", MAX_LOOKUP_INDEX); return; }
+        ix->used = ix->declared = ix->stale = 1;
+        ix->sheet = cur_sheet;
+        ix->col = col;
+    }
+    ix = lookup_index_find(cur_sheet, col);
+    if (!ix) { set_status("Sin memoria para el índice"); return; }
+    filter_epoch = 0;
+    set_status("Índice en %s: %d filas, %d valores numéricos", args, ix->nrows, ix->nrun);
+}
+
+void cmd_unindex(const char *args) {
+    while (isspace((unsigned char)*args)) args++;
+    int col = col_from_name(args);
+    for (int k = 0; k < MAX_LOOKUP_INDEX; k++) {
+        LookupIndex *ix = &lookup_ix[k];
+        if (ix->used && ix->declared && ix->sheet == cur_sheet && ix->col == col) {
+            ix_free(ix);
+            filter_epoch = 0;
+            set_status("Índice en %s eliminado", args);
+            return;
+        }
+    }
+    set_status("No hay índice en %s", args);
+}
+
+// Panel centrado con líneas "clave valor"; se cierra con cualquier tecla
+static void show_lines(const char *title, char lines[][64], int n) {
+    int h = n + 4, w = 50;
+    WINDOW *win = newwin(h, w, (LINES - h) / 2, (COLS - w) / 2);
+    if (!win) return;
+    box(win, 0, 0);
+    mvwprintw(win, 0, 2, "%s", title);
+    for (int i = 0; i < n; i++) {
+        char *sp = strchr(lines[i], ' ');
+        if (sp) *sp = '\0';
+        mvwprintw(win, i + 1, 2, "%-26s %s", lines[i], sp ? sp + 1 : "");
+    }
+    mvwprintw(win, h - 2, 2, "(cualquier tecla para cerrar)");
+    wrefresh(win);
+    wgetch(win);
+    delwin(win);
+}
+
+// Vuelca las líneas a un archivo; 0 si no se pudo escribir
+static int dump_lines(const char *file, char lines[][64], int n) {
+    FILE *f = fopen(file, "w");
+    if (!f) { set_status("No se puede escribir: %s", file); return 0; }
+    for (int i = 0; i < n; i++) fprintf(f, "%s\n", lines[i]);
+    fclose(f);
+    return 1;
+}
+
+// Líneas "clave valor" con los contadores (las usan el panel y el volcado)
+static int counters_lines(char lines[][64], int max) {
+    struct mallinfo2 mi = mallinfo2();
+    Counters c = counters;
+    int n = 0;
+#define LINE(...) if (n < max) snprintf(lines[n++], 64, __VA_ARGS__)
+    LINE("evaluaciones %llu", c.evals);
+    LINE("evaluaciones_recursivas %llu", c.evals_nested);
+    LINE("cuadro_evaluaciones %llu", c.frame_evals);
+    LINE("cuadro_recursivas %llu", c.frame_nested);
+    LINE("cuadro_max_evaluaciones %llu", c.max_frame_evals);
+    LINE("cache_aciertos %llu", c.cache_hits);
+    LINE("cache_fallos %llu", c.cache_misses);
+    LINE("plantillas_compiladas %llu", c.templates);
+    LINE("bytes_en_uso %zu", mi.uordblks + mi.hblkhd);
+    LINE("bytes_terminal %llu", c.term_bytes);
+    LINE("filas_filtradas %llu", c.filter_rows);
+    LINE("tiempo_formulas_ms %.3f", c.eval_ns / 1e6);
+    LINE("cuadros %llu", c.frames);
+#undef LINE
+    return n;
+}
+
+// :stats muestra los contadores; :stats reset los pone a cero;
+// :stats archivo los vuelca como "clave valor"
+void cmd_stats(char *args) {
+    char lines[16][64];
+    while (isspace((unsigned char)*args)) args++;
+    if (strcmp(args, "reset") == 0) {
+        memset(&counters, 0, sizeof(counters));
+        set_status("Contadores a cero");
+        return;
+    }
+    int n = counters_lines(lines, 16);
+    if (*args) {
+        if (dump_lines(args, lines, n)) set_status("Contadores en %s", args);
+        return;
+    }
+    show_lines(" Contadores ", lines, n);
+}
+
+size_t search_index_bytes();
+
+// Líneas "clave valor" con la memoria por categoría. Las celdas ocupan
+// siempre CELL_LEN bytes; por clase se da cuántas hay, los bytes de texto
+// que usan de verdad y lo que cuesta cada una contando la reserva.
+static int mem_lines(char lines[][64], int max) {
+    enum { M_EMPTY, M_NUM, M_DATE, M_TEXT, M_FORMULA, M_CLASSES };
+    static const char *cls_name[M_CLASSES] = { "vacias", "numeros", "fechas", "texto", "formulas" };
+    long long count[M_CLASSES] = {0}, payload[M_CLASSES] = {0};
+    size_t sheet_bytes = 0;
+    sheet_store();
+    for (int k = 0; k < nsheets; k++) {
+        Cell (*cells)[MAX_COLS] = sheets[k].cells;
+        sheet_bytes += (size_t)MAX_ROWS * MAX_COLS * sizeof(Cell);
+        for (int r = 0; r < sheets[k].nrows; r++)
+            for (int c = 0; c < sheets[k].ncols; c++) {
+                const char *d = cells[r][c].data;
+                double v;
+                int m;
+                if (d[0] == '=') m = M_FORMULA;
+                else switch (classify_cell(d, &v)) {
+                    case COL_EMPTY: m = M_EMPTY; break;
+                    case COL_INT: case COL_FLOAT: m = M_NUM; break;
+                    case COL_DATE: m = M_DATE; break;
+                    default: m = M_TEXT;
+                }
+                count[m]++;
+                if (m != M_EMPTY) payload[m] += strlen(d) + 1;
+            }
+    }
+    long long used = 0, live = 0;
+    for (int m = M_NUM; m < M_CLASSES; m++) { used += payload[m]; live += count[m]; }
+    // ncurses: stdscr, curscr y newscr, un chtype por posición
+    size_t render = 3 * (size_t)LINES * COLS * sizeof(chtype);
+    struct mallinfo2 mi = mallinfo2();
+    int n = 0;
+#define LINE(...) if (n < max) snprintf(lines[n++], 64, __VA_ARGS__)
+    LINE("hojas_reservado %zu", sheet_bytes);
+    LINE("texto_en_uso %lld", used);
+    LINE("bytes_por_celda %.1f", live ? (double)sheet_bytes / live : 0.0);
+    for (int m = 0; m < M_CLASSES; m++)
+        LINE("%s %lld (%lld B, %.1f B/celda)", cls_name[m], count[m], payload[m],
+             count[m] ? (double)payload[m] / count[m] : 0.0);
+    // las fórmulas se interpretan desde su texto: ese es su "programa"
+    LINE("programas_formula %lld", payload[M_FORMULA]);
+    LINE("caches %zu", sizeof(cached_val) + sizeof(cached_epoch) + sizeof(col_meta) +
+                       sizeof(col_stats_cache) + sizeof(first_cell) +
+                       sizeof(eval_state) + sizeof(eval_nospec) +
+                       (eval_cap + eval_deferred_cap) * sizeof(EvalFrame));
+    LINE("deshacer 0");
+    LINE("indices_busqueda %zu", lookup_index_bytes());
+    LINE("indice_texto %zu", search_index_bytes());
+    LINE("render %zu", render);
+    LINE("heap_en_uso %zu", mi.uordblks + mi.hblkhd);
+#undef LINE
+    return n;
+}
+
+// :mem muestra la memoria por categoría; :mem archivo la vuelca
+void cmd_mem(char *args) {
+    char lines[24][64];
+    while (isspace((unsigned char)*args)) args++;
+    int n = mem_lines(lines, 24);
+    if (*args) {
+        if (dump_lines(args, lines, n)) set_status("Memoria en %s", args);
+        return;
+    }
+    show_lines(" Memoria ", lines, n);
+}
+
+// :trace start | :trace stop [archivo.json]
+void cmd_trace(char *args) {
+    char *op = strtok(args, " \t"), *file = strtok(NULL, " \t");
+    if (op && strcmp(op, "start") == 0) {
+        trace_start();
+        set_status("Trazas activadas");
+    } else if (op && strcmp(op, "stop") == 0) {
+        if (!file) file = "yape_trace.json";
+        long n = trace_stop(file);
+        if (n < 0) set_status("No se puede escribir: %s", file);
+        else set_status("%ld eventos en %s", n, file);
+    } else {
+        set_status("Uso: :trace start | :trace stop [archivo.json]");
+    }
+}
+
+void run_command(char *cmd) {
+    TRACE_SCOPE("command");
+    while (isspace((unsigned char)*cmd)) cmd++;
+    char *args = cmd;
+    while (*args && !isspace((unsigned char)*args)) args++;
+    if (*args) *args++ = '\0';
+
+    if (strcmp(cmd, "groupby") == 0) cmd_groupby(args);
+    else if (strcmp(cmd, "sheet") == 0) cmd_sheet(args);
+    else if (strcmp(cmd, "open") == 0) cmd_open(args);
+    else if (strcmp(cmd, "index") == 0) cmd_index(args);
+    else if (strcmp(cmd, "unindex") == 0) cmd_unindex(args);
+    else if (strcmp(cmd, "nohl") == 0) search_hl[0] = '\0';
+    else if (strcmp(cmd, "dedup") == 0) cmd_dedup(args);
+    else if (strcmp(cmd, "diff") == 0) cmd_diff(args);
+    else if (strcmp(cmd, "top") == 0) cmd_topk(args, 1);
+    else if (strcmp(cmd, "bottom") == 0) cmd_topk(args, -1);
+    else if (strcmp(cmd, "quantile") == 0) cmd_quantile(args);
+    else if (strcmp(cmd, "select") == 0) cmd_select(args);
+    else if (strcmp(cmd, "trace") == 0) cmd_trace(args);
+    else if (strcmp(cmd, "stats") == 0) cmd_stats(args);
+    else if (strcmp(cmd, "mem") == 0) cmd_mem(args);
+    else if (cmd[0]) set_status("Comando desconocido: %s", cmd);
+}
+
+void prompt_command() {
+    char cmd[256];
+    echo();
+    mvprintw(LINES - 1, 0, ":");
+    clrtoeol();
+    getnstr(cmd, sizeof(cmd) - 1);
+    noecho();
+    status_msg[0] = '\0';
+    run_command(cmd);
+}
+
+// --- RECÁLCULO POR TRAMOS ---
+// Un cuadro evalúa a lo sumo RECALC_FRAME_MS; las celdas visibles que quedan
+// se dibujan con ~ y, mientras no se pulsa ninguna tecla (getch_idle), se
+// terminan en tramos de RECALC_SLICE_MS y se vuelve a dibujar. Solo se
+// calcula lo visible y sus precedentes: las fórmulas fuera de pantalla
+// siguen sin evaluar hasta que se desplaza hasta ellas o se guarda (ver
+// formula_value). Un tramo se corta aunque esté dentro de una cadena larga
+// de referencias (eval_budget): lo calculado queda en el caché y el tramo
+// siguiente sigue. El filtro y los índices de búsqueda que se construyen
+// con el plazo agotado no se guardan: cuentan como pendientes y se rehacen
+// en el tramo siguiente. Una edición nueva cambia sheet_epoch y el cuadro
+// siguiente vuelve a medir lo pendiente.
+
+#define RECALC_SLICE_MS 5
+
+int recalc_pending() {
+    return nsheets > 0 && frame_stale;
+}
+
+// Evalúa las fórmulas visibles durante unos milisegundos; 1 si hay que
+// volver a dibujar (siempre: el cuadro siguiente mide lo que quede)
+int recalc_step() {
+    TRACE_SCOPE("recalc");
+    eval_budget(RECALC_SLICE_MS);
+    filter_matches(0);
+    for (int i = row_offset, line = 0; i < nrows && line < LINES - 5 && !eval_aborted; i++) {
+        if (!filter_matches(i)) continue;
+        for (int c = col_offset; c < ncols && c < col_offset + COLS / 12 && !eval_aborted; c++)
+            if (sheet[i][c].data[0] == '=') formula_value(i, c);
+        line++;
+    }
+    if (!eval_aborted && !filter_pending()) frame_stale = 0;
+    eval_budget(0);
+    return 1;
+}
+
+// --- BÚSQUEDA (/) ---
+// /patrón busca en el texto de todas las celdas (sin distinguir mayúsculas)
+// y n/N saltan a la siguiente/anterior coincidencia. Un índice invertido de
+// trigramas se construye por tramos mientras no se pulsa ninguna tecla
+// (getch_idle). Las ediciones solo añaden entradas: los candidatos se
+// verifican siempre contra la celda, así que las entradas viejas cuestan
+// una comparación. Las filas aún sin indexar y los patrones de menos de
+// 3 letras se recorren.
+//
+// /"texto" busca celdas enteras: la clave de la celda igual a texto, como
+// en VLOOKUP (los números por valor). Las columnas con :index lo resuelven
+// con su hash, igual que los filtros.
+
+#define TG_BUCKETS 65536
+#define TG_SLICE_MS 8
+
+typedef struct {
+    uint32_t *ids;        // fila * MAX_COLS + col
+    int n, cap;
+} TgList;
+
+TgList tg_bucket[TG_BUCKETS];
+int tg_rows = 0;          // filas [0, tg_rows) ya indexadas
+long tg_total = 0, tg_stale = 0;
+
+char search_pat[CELL_LEN];
+uint32_t *search_hits = NULL;
+int search_nhits = 0, search_cap = 0;
+unsigned search_epoch = 0;
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static unsigned tg_slot(const char *p) {
+    uint32_t t = (uint32_t)tolower((unsigned char)p[0]) << 16
+               | (uint32_t)tolower((unsigned char)p[1]) << 8
+               | (uint32_t)tolower((unsigned char)p[2]);
+    return (t * 2654435761u) >> 16;
+}
+
+static void tg_add_text(const char *d, uint32_t id) {
+    for (int i = 0; d[i] && d[i + 1] && d[i + 2]; i++) {
+        TgList *l = &tg_bucket[tg_slot(d + i)];
+        if (l->n && l->ids[l->n - 1] == id) continue;
+        if (l->n == l->cap) {
+            int cap = l->cap ? l->cap * 2 : 16;
+            uint32_t *ids = realloc(l->ids, cap * sizeof(uint32_t));
+            if (!ids) return;
+            l->ids = ids;
+            l->cap = cap;
+        }
+        l->ids[l->n++] = id;
+        tg_total++;
+    }
+}
+
+static void tg_add_cell(int row, int col) { tg_add_text(sheet[row][col].data, row * MAX_COLS + col); }
+
+// La hoja cambió de forma: se vuelve a indexar desde el principio
+void search_index_reset() {
+    for (int b = 0; b < TG_BUCKETS; b++) tg_bucket[b].n = 0;
+    tg_rows = 0;
+    tg_total = tg_stale = 0;
+}
+
+void search_index_cell_changed(int row, int col) {
+    if (row >= tg_rows) return;    // se indexará al llegar a ella
+    tg_stale += strlen(sheet[row][col].data);
+    tg_add_cell(row, col);
+    if (tg_stale > tg_total / 2 + 4096) search_index_reset();
+}
+
+// Columna de un .msheet recién decodificada: se añaden las filas que el
+// recorrido ya pasó (decode_col puede llegar con `sheet` en otra hoja)
+void search_index_col_decoded(int col) {
+    for (int r = 0; r < tg_rows; r++) tg_add_text(ms_cells[r][col].data, r * MAX_COLS + col);
+}
+
+int search_index_pending() { return tg_rows < nrows; }
+
+// Indexa filas durante unos milisegundos; las columnas de un .msheet aún
+// sin decodificar se saltan y se añaden cuando algo las decodifica
+void search_index_step() {
+    TRACE_SCOPE("search_index");
+    double t0 = now_ms();
+    while (tg_rows < nrows) {
+        for (int c = 0; c < ncols; c++)
+            if (col_decoded(c)) tg_add_cell(tg_rows, c);
+        tg_rows++;
+        if ((tg_rows & 15) == 0 && now_ms() - t0 > TG_SLICE_MS) break;
+    }
+}
+
+// Espera una tecla; mientras no llega avanza el trabajo pendiente
+int getch_idle() {
+    int ch, redraw = 0;
+    while (redraw || recalc_pending() || search_index_pending()) {
+        timeout(0);
+        ch = getch();
+        if (ch != ERR) { timeout(-1); return ch; }
+        if (redraw) { draw_sheet_filtered(); redraw = 0; }
+        else if (recalc_pending()) redraw = recalc_step();
+        else search_index_step();
+    }
+    timeout(-1);
+    return getch();
+}
+
+static int contains_nocase(const char *s, const char *pat) {
+    for (; *s; s++) {
+        int i = 0;
+        while (pat[i] && tolower((unsigned char)s[i]) == tolower((unsigned char)pat[i])) i++;
+        if (!pat[i]) return 1;
+    }
+    return !pat[0];
+}
+
+static int search_exact(const char *pat) {
+    size_t n = strlen(pat);
+    return n > 2 && pat[0] == '"' && pat[n - 1] == '"';
+}
+
+// ¿Coincide la celda de la hoja activa (su rejilla en cells) con el patrón
+// de /? Las fórmulas de una búsqueda exacta cuentan por su valor si ya
+// está en el caché
+static int search_match(Cell (*cells)[MAX_COLS], int row, int col, const char *pat) {
+    const char *d = cells[row][col].data;
+    if (!search_exact(pat)) return contains_nocase(d, pat);
+    char text[CELL_LEN], key[CELL_LEN], k2[CELL_LEN];
+    snprintf(text, sizeof(text), "%.*s", (int)strlen(pat) - 2, pat + 1);
+    key_norm(text, key, sizeof(key));
+    if (d[0] != '=') key_norm(d, k2, sizeof(k2));
+    else if (__atomic_load_n(&cached_epoch[row][col], __ATOMIC_ACQUIRE) == sheet_epoch)
+        snprintf(k2, sizeof(k2), "%.15g", cached_val[row][col]);
+    else return 0;
+    return strcmp(k2, key) == 0;
+}
+
+static void search_push(uint32_t id) {
+    if (search_nhits == search_cap) {
+        int cap = search_cap ? search_cap * 2 : 1024;
+        uint32_t *hits = realloc(search_hits, cap * sizeof(uint32_t));
+        if (!hits) return;
+        search_hits = hits;
+        search_cap = cap;
+    }
+    search_hits[search_nhits++] = id;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Todas las celdas que contienen search_pat, en orden de fila
+static void search_collect() {
+    TRACE_SCOPE("search_collect");
+    int len = strlen(search_pat), from = 0;
+    search_nhits = 0;
+    for (int c = 0; c < ncols; c++) ensure_col(c);
+    if (search_exact(search_pat)) {
+        // columna a columna, con el índice declarado si lo hay (filter_eval)
+        char text[CELL_LEN];
+        unsigned char *rows = malloc(nrows ? nrows : 1);
+        if (!rows) return;
+        snprintf(text, sizeof(text), "%.*s", len - 2, search_pat + 1);
+        for (int c = 0; c < ncols; c++) {
+            filter_eval(c, FILTER_EQ, text, rows);
+            for (int r = 0; r < nrows; r++)
+                if (rows[r]) search_push(r * MAX_COLS + c);
+        }
+        free(rows);
+        qsort(search_hits, search_nhits, sizeof(uint32_t), cmp_u32);
+        search_epoch = sheet_epoch;
+        return;
+    }
+    if (len >= 3 && tg_rows > 0) {
+        // basta verificar la lista más corta de los trigramas del patrón
+        TgList *best = &tg_bucket[tg_slot(search_pat)];
+        for (int i = 1; i + 3 <= len; i++) {
+            TgList *l = &tg_bucket[tg_slot(search_pat + i)];
+            if (l->n < best->n) best = l;
+        }
+        for (int k = 0; k < best->n; k++) {
+            uint32_t id = best->ids[k];
+            int r = id / MAX_COLS, c = id % MAX_COLS;
+            if (r < tg_rows && r < nrows && c < ncols && contains_nocase(sheet[r][c].data, search_pat))
+                search_push(id);
+        }
+        qsort(search_hits, search_nhits, sizeof(uint32_t), cmp_u32);
+        int n = 0;
+        for (int k = 0; k < search_nhits; k++)
+            if (n == 0 || search_hits[k] != search_hits[n - 1]) search_hits[n++] = search_hits[k];
+        search_nhits = n;
+        from = tg_rows;
+    }
+    for (int r = from; r < nrows; r++)
+        for (int c = 0; c < ncols; c++)
+            if (contains_nocase(sheet[r][c].data, search_pat)) search_push(r * MAX_COLS + c);
+    search_epoch = sheet_epoch;
+}
+
+// Salta a la siguiente (dir = 1) o anterior (dir = -1) coincidencia visible
+void search_jump(int dir) {
+    if (!search_pat[0]) { set_status("Sin búsqueda: usa /patrón"); return; }
+    if (search_epoch != sheet_epoch) search_collect();
+    uint32_t cur = cur_row * MAX_COLS + cur_col;
+    int lo = 0, hi = search_nhits;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (search_hits[mid] <= cur) lo = mid + 1;
+        else hi = mid;
+    }
+    // lo: primera coincidencia después del cursor
+    int k = dir > 0 ? lo : lo - 1;
+    if (dir < 0 && k >= 0 && search_hits[k] == cur) k--;
+    for (int tries = 0; tries < search_nhits; tries++, k += dir) {
+        k = (k % search_nhits + search_nhits) % search_nhits;
+        int r = search_hits[k] / MAX_COLS;
+        if (!filter_matches(r)) continue;
+        cur_row = r;
+        cur_col = search_hits[k] % MAX_COLS;
+        set_status("/%s: %d de %d", search_pat, k + 1, search_nhits);
+        return;
+    }
+    set_status("Sin coincidencias: %s", search_pat);
+}
+
+int cell_highlighted(int row, int col) {
+    return search_hl[0] && search_match(sheet, row, col, search_hl);
+}
+
+// --- búsqueda mientras se escribe ---
+// Cada tecla del prompt lanza un hilo que recorre la hoja desde la fila del
+// cursor hacia fuera (cur_row, +1, -1, +2, ...), así las coincidencias
+// cercanas aparecen primero; la tecla siguiente lo cancela. Durante el
+// prompt no se edita la hoja, así que el hilo solo lee celdas ya
+// decodificadas. El hilo no usa `sheet` (dibujar evalúa fórmulas y eso la
+// cambia mientras lee otra hoja): recibe la rejilla y su tamaño al empezar,
+// y prompt_search lo para antes de volver, así que nunca ve un cambio de
+// hoja. El bucle de ncurses nunca espera al recorrido. Los campos marcados
+// se comparten con el hilo mientras corre: se leen y escriben con __atomic
+// (adquisición/liberación), como los anillos de trazas.
+
+typedef struct {
+    pthread_t thread;
+    int running;
+    int cancel;                // compartido: lo pone la interfaz
+    int done;                  // compartido
+    char pat[CELL_LEN];
+    Cell (*cells)[MAX_COLS];   // hoja activa al empezar
+    int nrows, ncols;
+    int origin;                // fila desde la que se recorre
+    uint32_t *hits;            // solo se lee tras pthread_join
+    int cap;
+    int nhits;                 // compartido
+    int rows;                  // compartido: filas recorridas
+    long first;                // compartido: primera coincidencia (-1 ninguna)
+} IncSearch;
+
+IncSearch inc;
+
+// Memoria del índice de trigramas y de las listas de coincidencias (ver :mem)
+size_t search_index_bytes() {
+    size_t b = 0;
+    for (int t = 0; t < TG_BUCKETS; t++) b += tg_bucket[t].cap * sizeof(uint32_t);
+    return b + (search_cap + inc.cap) * sizeof(uint32_t);
+}
+
+static void *inc_worker(void *arg) {
+    TRACE_SCOPE("search_worker");
+    IncSearch *w = arg;
+    int n = 0, rows = 0;
+    for (int k = 0; k < 2 * w->nrows && !__atomic_load_n(&w->cancel, __ATOMIC_ACQUIRE); k++) {
+        int r = w->origin + (k & 1 ? (k + 1) / 2 : -(k / 2));
+        if (r < 0 || r >= w->nrows) continue;
+        for (int c = 0; c < w->ncols; c++) {
+            if (!search_match(w->cells, r, c, w->pat)) continue;
+            if (n == w->cap) {
+                int cap = w->cap ? w->cap * 2 : 1024;
+                uint32_t *hits = realloc(w->hits, cap * sizeof(uint32_t));
+                if (!hits) break;
+                w->hits = hits;
+                w->cap = cap;
+            }
+            w->hits[n] = r * MAX_COLS + c;
+            if (n == 0) __atomic_store_n(&w->first, (long)w->hits[0], __ATOMIC_RELEASE);
+            __atomic_store_n(&w->nhits, ++n, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&w->rows, ++rows, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&w->done, !__atomic_load_n(&w->cancel, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void inc_stop() {
+    if (!inc.running) return;
+    __atomic_store_n(&inc.cancel, 1, __ATOMIC_RELEASE);
+    pthread_join(inc.thread, NULL);
+    inc.running = 0;
+}
+
+static void inc_start(const char *pat, int origin) {
+    inc_stop();
+    snprintf(inc.pat, sizeof(inc.pat), "%s", pat);
+    inc.origin = origin;
+    inc.cells = sheets[cur_sheet].cells;
+    inc.nrows = nrows;
+    inc.ncols = ncols;
+    inc.cancel = inc.done = 0;
+    inc.nhits = inc.rows = 0;
+    inc.first = -1;
+    if (!pat[0]) return;
+    inc.running = pthread_create(&inc.thread, NULL, inc_worker, &inc) == 0;
+}
+
+void prompt_search() {
+    char pat[CELL_LEN] = "";
+    char prev_hl[CELL_LEN];
+    int len = 0, ch;
+    int row0 = cur_row, col0 = cur_col;
+    snprintf(prev_hl, sizeof(prev_hl), "%s", search_hl);
+    for (int c = 0; c < ncols; c++) ensure_col(c);
+    status_msg[0] = '\0';
+
+    while (1) {
+        // vista previa: la coincidencia más cercana al cursor de partida
+        long first = __atomic_load_n(&inc.first, __ATOMIC_ACQUIRE);
+        int done = __atomic_load_n(&inc.done, __ATOMIC_ACQUIRE);
+        if (first >= 0) cur_row = first / MAX_COLS, cur_col = first % MAX_COLS;
+        else cur_row = row0, cur_col = col0;
+        snprintf(search_hl, sizeof(search_hl), "%s", pat);
+        draw_sheet_filtered();
+        mvprintw(LINES - 1, 0, "/%s", pat);
+        clrtoeol();
+        if (pat[0]) printw(done ? "   [%d]" : "   [%d...]", __atomic_load_n(&inc.nhits, __ATOMIC_ACQUIRE));
+        refresh();
+        timeout(inc.running && !done ? 30 : -1);
+        ch = getch();
+        if (ch == ERR && inc.running && !done) continue;
+        if (ch == ERR || ch == 27) {    // ERR sin espera: fin de la entrada
+            inc_stop();
+            cur_row = row0; cur_col = col0;
+            snprintf(search_hl, sizeof(search_hl), "%s", prev_hl);
+            timeout(-1);
+            return;
+        }
+        if (ch == '\n') break;
+        if ((ch == KEY_BACKSPACE || ch == 127) && len > 0) pat[--len] = '\0';
+        else if (ch >= 32 && ch <= 126 && len < CELL_LEN - 1) pat[len++] = (char)ch, pat[len] = '\0';
+        else continue;
+        inc_start(pat, row0);
+    }
+    timeout(-1);
+    cur_row = row0; cur_col = col0;
+    if (!pat[0]) {    // "/" solo repite la última
+        inc_stop();
+        snprintf(search_hl, sizeof(search_hl), "%s", search_pat);
+        search_jump(1);
+        return;
+    }
+    snprintf(search_pat, sizeof(search_pat), "%s", pat);
+    search_epoch = 0;
+    // recorrido completo ya hecho: se aprovecha en vez de volver a buscar
+    int done = inc.running && __atomic_load_n(&inc.done, __ATOMIC_ACQUIRE);
+    inc_stop();
+    if (done && strcmp(inc.pat, pat) == 0) {
+        search_nhits = 0;
+        for (int k = 0; k < inc.nhits; k++) search_push(inc.hits[k]);
+        qsort(search_hits, search_nhits, sizeof(uint32_t), cmp_u32);
+        search_epoch = sheet_epoch;
+    }
+    search_jump(1);
+}
+
+// Aplica una tecla; devuelve 0 para salir
+int handle_key(int ch) {
+    TRACE_SCOPE("key");
+    // --- Navegación tipo Vim ---
+    if (!formula_mode && !edit_mode) {
+        if (last_ch == 'g' && ch == 'g') { cur_row = 0; last_ch = 0; return 1; } // gg
+        if (last_ch == 'g' && ch == 't') { sheet_switch((cur_sheet + 1) % nsheets); last_ch = 0; return 1; } // gt
+        if (last_ch == 'g' && ch == 'T') { sheet_switch((cur_sheet + nsheets - 1) % nsheets); last_ch = 0; return 1; } // gT
+        if (ch == 'G') { cur_row = nrows-1; return 1; } // G
+        last_ch = (ch == 'g') ? 'g' : 0;
+
+        switch(ch) {
+            case 'q': return 0;
+            case '=': formula_mode = 1; formula_row = cur_row; formula_col = cur_col;
+                      strcpy(formula_buffer, "="); dynamic_pos = 1;
+                      ensure_col(cur_col); cell_touch(cur_row, cur_col);
+                      strcpy(sheet[cur_row][cur_col].data, formula_buffer); break;
+            case 'e': ensure_col(cur_col); edit_mode = 1; strcpy(edit_buffer, sheet[cur_row][cur_col].data); break;
+            case 'c': { echo(); char filename[256];
+                        mvprintw(nrows + 5, 0, "Archivo (.csv/.msheet) a cargar: ");
+                        getnstr(filename, 255); noecho(); load_file(filename);
+                        sheet_name_from_file(filename, sheets[cur_sheet].name, sizeof(sheets[cur_sheet].name));
+                        cur_row = cur_col = 0; break; }
+            case 's': { echo(); char filename[256];
+                        mvprintw(nrows + 5, 0, "Archivo (.csv/.msheet) a guardar: ");
+                        getnstr(filename, 255); noecho(); save_file(filename); break; }
+            case 'h': if(cur_col>0) cur_col--; break;
+            case 'l': if(cur_col<ncols-1) cur_col++; break;
+            case 'k': if(cur_row>0) cur_row--; break;
+            case 'j': if(cur_row<nrows-1) cur_row++; break;
+            case 'i': insert_row(cur_row); break;
+            case 'd': remove_row(cur_row); break;
+            case 'I': insert_col(cur_col); break;
+            case 'D': remove_col(cur_col); break;
+            case 'f': fill_formula_column(cur_col); break;
+            case 'R': duplicate_row(cur_row); break;
+            case 'C': duplicate_col(cur_col); break;
+            case '0': cur_col = 0; break;           // inicio de fila
+            case '$': cur_col = ncols-1; break;     // fin de fila
+            case 'H': cur_col = col_offset; break;  // inicio visible
+            case 'L': cur_col = col_offset + (COLS/12) -1; break; // fin visible
+            case 'F': activate_filter(); break;    // activar filtro
+            case 'U': deactivate_filter(); break;  // quitar filtro
+            case 'S': show_col_stats(cur_col); break; // estadísticas de columna
+            case ':': prompt_command(); break;
+            case '/': prompt_search(); break;
+            case 'n': search_jump(1); break;
+            case 'N': search_jump(-1); break;
+        }
+    } else if (edit_mode) {
+        if (ch == 27) edit_mode = 0;
+        else if (ch == '\n') {
+            strncpy(sheet[cur_row][cur_col].data, edit_buffer, CELL_LEN-1);
+            sheet[cur_row][cur_col].data[CELL_LEN-1] = '\0';
+            sanitize(sheet[cur_row][cur_col].data);
+            cell_touch(cur_row, cur_col);
+            edit_mode = 0;
+            if (cur_row < nrows-1) cur_row++;
+        } else if (ch == KEY_BACKSPACE || ch == 127) {
+            int len = strlen(edit_buffer);
+            if (len > 0) edit_buffer[len-1] = '\0';
+        } else if (ch >= 32 && ch <= 126) {
+            int len = strlen(edit_buffer);
+            if (len < CELL_LEN-1) {
+                edit_buffer[len] = (char)ch;
+                edit_buffer[len+1] = '\0';
+            }
+        }
+    } else {
+        if (ch == 27) formula_mode = 0, formula_row = formula_col = -1, dynamic_pos = -1;
+        else if (ch == '\n') formula_mode = 0, formula_row = formula_col = -1, dynamic_pos = -1;
+        else if (ch == 'h' && cur_col>0) { cur_col--; update_dynamic_ref(); }
+        else if (ch == 'l' && cur_col<ncols-1) { cur_col++; update_dynamic_ref(); }
+        else if (ch == 'k' && cur_row>0) { cur_row--; update_dynamic_ref(); }
+        else if (ch == 'j' && cur_row<nrows-1) { cur_row++; update_dynamic_ref(); }
+        else if (ch == '+' || ch == '-' || ch == '*' || ch == '/') {
+            int len = strlen(formula_buffer);
+            if (len < FORMULA_MAX-2) {
+                formula_buffer[len] = (char)ch;
+                formula_buffer[len+1] = '\0';
+                dynamic_pos = len+1;
+                strcpy(sheet[formula_row][formula_col].data, formula_buffer);
+                cell_touch(formula_row, formula_col);
+            }
+        }
+
+    }
+    return 1;
+}
+
+// --- REPRODUCCIÓN DE TECLAS ---
+// yape --replay guion.keys [archivo] pasa las teclas del guion por
+// handle_key, igual que el bucle principal, dibujando en una terminal
+// sin salida (newterm sobre /dev/null), y mide el tiempo de cada tecla
+// hasta el cuadro dibujado. Al final muestra p50/p99/máx por tipo de
+// comando. En el guion \n es Enter, \e Escape, \\ la barra; los saltos
+// de línea reales se ignoran y las líneas que empiezan por # son
+// comentarios. Las teclas que piden texto (F, :, /, c, s) lo leen del
+// propio guion, como lo leerían de la terminal.
+
+enum { RK_NAV, RK_EDIT_TYPE, RK_EDIT_COMMIT, RK_FORMULA, RK_INSDEL, RK_FILTER,
+       RK_SEARCH, RK_COMMAND, RK_OTHER, RK_KINDS };
+
+static const char *replay_kind_name[RK_KINDS] = {
+    "j/k/h/l", "e (tecleo)", "e (Enter)", "= fórmula", "i/d/I/D", "F filtro",
+    "/ búsqueda", ": comando", "otras",
+};
+
+static int replay_kind(int ch) {
+    if (edit_mode) return ch == '\n' ? RK_EDIT_COMMIT : RK_EDIT_TYPE;
+    if (formula_mode || ch == '=') return RK_FORMULA;
+    switch (ch) {
+        case 'h': case 'j': case 'k': case 'l': return RK_NAV;
+        case 'i': case 'd': case 'I': case 'D': return RK_INSDEL;
+        case 'F': case 'U': return RK_FILTER;
+        case '/': case 'n': case 'N': return RK_SEARCH;
+        case ':': return RK_COMMAND;
+    }
+    return RK_OTHER;
+}
+
+// Guion legible -> bytes de teclas en un archivo temporal
+static FILE *replay_keys(const char *script) {
+    FILE *in = fopen(script, "r"), *out = tmpfile();
+    if (!in || !out) {
+        if (in) fclose(in);
+        if (out) fclose(out);
+        return NULL;
+    }
+    int c, bol = 1;
+    while ((c = fgetc(in)) != EOF) {
+        if (bol && c == '#') {
+            while ((c = fgetc(in)) != EOF && c != '\n') ;
+            continue;
+        }
+        bol = c == '\n';
+        if (c == '\n' || c == '\r') continue;
+        if (c == '\\') {
+            c = fgetc(in);
+            if (c == 'n') c = '\n';
+            else if (c == 'e') c = 27;
+            else if (c == 't') c = '\t';
+            else if (c == EOF) break;
+        }
+        fputc(c, out);
+    }
+    fclose(in);
+    rewind(out);
+    return out;
+}
+
+int replay(const char *script, const char *file) {
+    static double samples[RK_KINDS][4096];
+    int nsamples[RK_KINDS] = { 0 };
+    FILE *keys = replay_keys(script);
+    FILE *devnull = fopen("/dev/null", "w");
+    if (!keys || !devnull) { fprintf(stderr, "No se puede leer %s\n", script); return 1; }
+    if (!getenv("TERM")) setenv("TERM", "xterm", 1);
+    SCREEN *scr = newterm(NULL, devnull, keys);
+    if (!scr) { fprintf(stderr, "newterm falló\n"); return 1; }
+    noecho();
+    keypad(stdscr, TRUE);
+    sheet_new("hoja1");
+    sheet = sheets[0].cells;
+    if (file) load_file(file);
+    draw_sheet_filtered();
+
+    int ch, keys_total = 0;
+    double t_total = now_ms();
+    while ((ch = getch()) != ERR) {
+        // pausa del usuario: el trabajo de fondo termina entre teclas
+        while (recalc_pending()) recalc_step();
+        while (search_index_pending()) search_index_step();
+        int kind = replay_kind(ch);
+        double t0 = now_ms();
+        int more = handle_key(ch);
+        if (more) draw_sheet_filtered();
+        double dt = now_ms() - t0;
+        if (nsamples[kind] < 4096) samples[kind][nsamples[kind]++] = dt;
+        keys_total++;
+        if (!more) break;
+    }
+    t_total = now_ms() - t_total;
+    endwin();
+    delscreen(scr);
+
+    printf("%d teclas en %.1f ms\n", keys_total, t_total);
+    printf("%-12s %6s %9s %9s %9s\n", "comando", "n", "p50 ms", "p99 ms", "máx ms");
+    for (int k = 0; k < RK_KINDS; k++) {
+        int n = nsamples[k];
+        if (!n) continue;
+        qsort(samples[k], n, sizeof(double), cmp_double);
+        printf("%-12s %6d %9.3f %9.3f %9.3f\n", replay_kind_name[k], n,
+               samples[k][(n - 1) / 2], samples[k][(int)(0.99 * (n - 1) + 0.5)], samples[k][n - 1]);
+    }
+    char lines[16][64];
+    int n = counters_lines(lines, 16);
+    for (int i = 0; i < n; i++) printf("  %s\n", lines[i]);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 3 && strcmp(argv[1], "--replay") == 0)
+        return replay(argv[2], argc > 3 ? argv[3] : NULL);
+    initscr();
+    cbreak();
+    noecho();
+    keypad(stdscr, TRUE);
+    sheet_new("hoja1");
+    sheet = sheets[0].cells;
+    while (1) {
+        draw_sheet_filtered();
+        if (!handle_key(getch_idle())) break;
     }
     endwin();
     return 0;